@@ -3,6 +3,25 @@
 #include <string>
 #include <fstream>
 #include <stdexcept>
+#include <sstream>
+#include <cmath>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <charconv>
+#include <cstring>
+#include <unordered_map>
+#include <ctime>
+#include <iomanip>
+#include <optional>
+
+#include <thread>
+#include "CommandProtocol.h"
+#include "CommandServer.h"
+#include "OperationStats.h"
+#include "RecordStore.h"
 
 using namespace std;
 
@@ -31,10 +50,13 @@ public:
         balance -= amount;
     }
 
+    // Puts back a balance read earlier, for undoing a change that could not be made durable
+    void restoreBalance(double previous) { balance = previous; }
+
     virtual string getAccountType() const = 0; // Pure virtual function for account type
 
-    virtual void display() const {
-        cout << "Account Number: " << accountNumber << ", Balance: $" << balance << endl;
+    virtual void display(ostream& out = cout) const {
+        out << "Account Number: " << accountNumber << ", Balance: $" << balance << endl;
     }
 };
 
@@ -77,11 +99,12 @@ private:
     int accountNumber;
     string type;
     double amount;
+    time_t time;  // When it was posted; 0 for entries from before postings were timestamped
 
 public:
     // Constructor
-    Transaction(int accNum, const string& t, double amt)
-        : accountNumber(accNum), type(t), amount(amt) {}
+    Transaction(int accNum, const string& t, double amt, time_t when = 0)
+        : accountNumber(accNum), type(t), amount(amt), time(when) {}
 
     // Getter for accountNumber
     int getAccountNumber() const { return accountNumber; }
@@ -92,34 +115,455 @@ public:
     // Getter for amount
     double getAmount() const { return amount; }
 
+    time_t getTime() const { return time; }
+
+    // Signed change this posting made to its account's balance
+    double balanceEffect() const {
+        if (type == "Withdrawal" || type == "Transfer Out" || type == "Fee") return -amount;
+        return amount;  // Opening, Deposit, Transfer In, Interest
+    }
+
     // Method to display transaction details
-    void display() const {
-        cout << "Account Number: " << accountNumber
+    void display(ostream& out = cout) const {
+        out << "Account Number: " << accountNumber
              << ", Type: " << type
              << ", Amount: $" << amount << endl;
     }
 };
 
+// End-of-day terms for one account type. Interest accrues daily at annualInterestRate / 365 on
+// positive balances; the fee is charged once per day, capped so no account goes negative.
+struct EndOfDayRates {
+    double annualInterestRate = 0;
+    double dailyFee = 0;
+};
+
+struct EndOfDayReport {
+    size_t accounts = 0;
+    size_t interestPostings = 0;
+    size_t feePostings = 0;
+    double interestPaid = 0;
+    double feesCharged = 0;
+    double seconds = 0;
+};
+
+// A limit on money leaving an account within a rolling window, e.g. "at most 5 withdrawals
+// or $2000 per hour". A zero maxCount or maxAmount leaves that dimension unlimited.
+struct VelocityRule {
+    enum Scope { Withdrawals, Transfers, AllDebits };
+
+    Scope scope = AllDebits;
+    int windowSeconds = 3600;
+    unsigned maxCount = 0;
+    double maxAmount = 0;
+
+    bool covers(Scope operation) const { return scope == AllDebits || scope == operation; }
+};
+
+// Enforces VelocityRules without looking at the transaction history. Each active account
+// keeps, per rule, a ring of kSlots time slots with running totals, so a check or an update is
+// O(1) whatever the account's history: advancing the ring expires at most kSlots slots. The
+// window therefore slides in steps of 1/kSlots of its length.
+//
+// Accounts are found through an open-addressing table whose entries point into one flat pool
+// of windows (the account's windows sit next to each other), so a check costs a few cache
+// misses and no allocation. State for accounts idle longer than every window is dropped
+// whenever the tracked set doubles, bounding memory by the number of recently active accounts.
+// Counters live in memory only and start empty after a restart.
+class VelocityLimiter {
+public:
+    void setRules(const vector<VelocityRule>& newRules) {
+        rules = newRules;
+        longestWindowMs = 0;
+        for (const VelocityRule& rule : rules) longestWindowMs = max(longestWindowMs, int64_t(rule.windowSeconds) * 1000);
+        rebuild(0, false);
+    }
+
+    const vector<VelocityRule>& getRules() const { return rules; }
+
+    // Returns why taking `amount` out of the account now would break a rule covering
+    // `operation`, or nullptr if it wouldn't. Nothing is counted until record() is called.
+    const char* check(int accountNumber, VelocityRule::Scope operation, double amount, int64_t nowMs) {
+        if (rules.empty()) return nullptr;
+        uint32_t entry = find(accountNumber);
+        Window* windows = entry == kNone ? nullptr : &pool[size_t(entry) * rules.size()];  // Untracked: every window is empty
+        for (size_t r = 0; r < rules.size(); ++r) {
+            const VelocityRule& rule = rules[r];
+            if (!rule.covers(operation)) continue;
+            uint32_t count = 0;
+            double total = 0;
+            if (windows) {
+                windows[r].advance(slotOf(rule, nowMs));
+                count = windows[r].count;
+                total = windows[r].amount;
+            }
+            if (rule.maxCount && count + 1 > rule.maxCount) return "too many debits in window";
+            if (rule.maxAmount > 0 && total + amount > rule.maxAmount + 1e-9) return "amount over window limit";
+        }
+        return nullptr;
+    }
+
+    void record(int accountNumber, VelocityRule::Scope operation, double amount, int64_t nowMs) {
+        if (rules.empty()) return;
+        uint32_t entry = find(accountNumber);
+        if (entry == kNone) entry = insert(accountNumber);
+        lastActivity[entry] = nowMs;
+        Window* windows = &pool[size_t(entry) * rules.size()];
+        for (size_t r = 0; r < rules.size(); ++r) {
+            if (!rules[r].covers(operation)) continue;
+            windows[r].advance(slotOf(rules[r], nowMs));
+            windows[r].add(amount);
+        }
+        if (lastActivity.size() >= pruneAt) rebuild(nowMs, true);
+    }
+
+    size_t trackedAccounts() const { return lastActivity.size(); }
+
+private:
+    static constexpr unsigned kSlots = 8;
+    static constexpr size_t kMinPruneSize = 1024;
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    class Window {
+    public:
+        uint32_t count = 0;
+        double amount = 0;
+
+        // Moves the window's leading edge to `slot`, dropping whatever fell out behind it
+        void advance(int64_t slot) {
+            if (slot - current >= int64_t(kSlots)) {
+                *this = Window();
+                current = slot;
+                return;
+            }
+            while (current < slot) {
+                unsigned expired = ++current % kSlots;
+                count -= slotCounts[expired];
+                amount -= slotAmounts[expired];
+                slotCounts[expired] = 0;
+                slotAmounts[expired] = 0;
+            }
+        }
+
+        void add(double value) {
+            ++slotCounts[current % kSlots];
+            slotAmounts[current % kSlots] += value;
+            ++count;
+            amount += value;
+        }
+
+    private:
+        int64_t current = 0;
+        uint32_t slotCounts[kSlots] = {};
+        double slotAmounts[kSlots] = {};
+    };
+
+    struct TableEntry {
+        int accountNumber;
+        uint32_t entry;  // Index into lastActivity; kNone marks a free table slot
+    };
+
+    vector<VelocityRule> rules;
+    int64_t longestWindowMs = 0;
+    vector<TableEntry> table;      // Open addressing, linear probing, at most half full
+    vector<int64_t> lastActivity;  // Per tracked account
+    vector<int> accountOf;         // Per tracked account, for rebuilds
+    vector<Window> pool;           // rules.size() windows per tracked account
+    size_t pruneAt = kMinPruneSize;
+
+    static int64_t slotOf(const VelocityRule& rule, int64_t nowMs) {
+        int64_t slotMs = max<int64_t>(1, int64_t(rule.windowSeconds) * 1000 / kSlots);
+        return nowMs / slotMs;
+    }
+
+    size_t home(int accountNumber) const {
+        return (uint32_t(accountNumber) * 0x9E3779B1u) & (table.size() - 1);
+    }
+
+    uint32_t find(int accountNumber) const {
+        if (table.empty()) return kNone;
+        for (size_t i = home(accountNumber);; i = (i + 1) & (table.size() - 1)) {
+            if (table[i].entry == kNone || table[i].accountNumber == accountNumber) return table[i].entry;
+        }
+    }
+
+    uint32_t insert(int accountNumber) {
+        if ((lastActivity.size() + 1) * 2 > table.size()) grow();
+        uint32_t entry = static_cast<uint32_t>(lastActivity.size());
+        lastActivity.push_back(0);
+        accountOf.push_back(accountNumber);
+        pool.resize(pool.size() + rules.size());
+        place(accountNumber, entry);
+        return entry;
+    }
+
+    void place(int accountNumber, uint32_t entry) {
+        size_t i = home(accountNumber);
+        while (table[i].entry != kNone) i = (i + 1) & (table.size() - 1);
+        table[i] = TableEntry{ accountNumber, entry };
+    }
+
+    void grow() {
+        table.assign(max<size_t>(1024, table.size() * 2), TableEntry{ 0, kNone });
+        for (uint32_t entry = 0; entry < accountOf.size(); ++entry) place(accountOf[entry], entry);
+    }
+
+    // Rebuilds the table and pool; with `dropIdle`, only accounts active within the longest
+    // window are kept. Amortized O(1) per record since it runs once the tracked set has doubled.
+    void rebuild(int64_t nowMs, bool dropIdle) {
+        vector<int64_t> keptActivity;
+        vector<int> keptAccounts;
+        vector<Window> keptPool;
+        if (dropIdle) {
+            for (size_t entry = 0; entry < lastActivity.size(); ++entry) {
+                if (nowMs - lastActivity[entry] > longestWindowMs) continue;
+                keptActivity.push_back(lastActivity[entry]);
+                keptAccounts.push_back(accountOf[entry]);
+                keptPool.insert(keptPool.end(), pool.begin() + entry * rules.size(), pool.begin() + (entry + 1) * rules.size());
+            }
+        }
+        lastActivity.swap(keptActivity);
+        accountOf.swap(keptAccounts);
+        pool.swap(keptPool);
+        table.clear();
+        size_t capacity = 1024;
+        while (capacity < lastActivity.size() * 2) capacity *= 2;
+        table.assign(capacity, TableEntry{ 0, kNone });
+        for (uint32_t entry = 0; entry < accountOf.size(); ++entry) place(accountOf[entry], entry);
+        pruneAt = max(kMinPruneSize, lastActivity.size() * 2);
+    }
+};
+
+// Remembers the idempotency keys of applied operations, with a fingerprint of each operation,
+// for ttlSeconds and at most `capacity` keys (the oldest are forgotten first), so a retried
+// request is recognised instead of being applied twice.
+//
+// Nearly every request carries a new key, so lookups go through a Bloom filter first: each key
+// maps to one 64-bit word and four bits within it, so "definitely new" costs one hash and one
+// memory access. A Bloom filter can't forget, so there are two generations, interleaved word
+// by word so that testing both is still one access: keys are added to the current one, and once
+// it is ttlSeconds old the older one is cleared and becomes current. A key thus stays in a
+// filter for at least its TTL.
+//
+// Filter hits are confirmed against the exact set, which holds a 128-bit hash of each key
+// rather than the key: entries sit in a ring in the order they were added, so expiring or
+// evicting is popping the oldest, and an open-addressing table over the ring finds them. Nothing
+// is allocated per key.
+class IdempotencyCache {
+public:
+    struct Entry {
+        uint64_t keyHash;
+        uint64_t keyCheck;  // Second, independent hash of the key
+        time_t recordedAt;
+        uint64_t request;   // Fingerprint of the operation the key was used for
+    };
+
+    IdempotencyCache(size_t capacity, time_t ttlSeconds) : capacity(capacity), ttlSeconds(ttlSeconds) {
+        size_t words = 1024;
+        while (words * 4 < capacity) words *= 2;  // About 16 bits per key and generation
+        filters.assign(words * 2, 0);
+    }
+
+    // The entry for `key`, or nullptr if the key hasn't been used within the TTL
+    const Entry* find(const string& key, time_t now) {
+        expire(now);
+        uint64_t hash = std::hash<string>()(key);
+        uint64_t mask = probeMask(hash);
+        const uint64_t* pair = &filters[wordOf(hash)];
+        if ((pair[0] & mask) != mask && (pair[1] & mask) != mask) return nullptr;
+        uint64_t check = checkHash(key);
+        for (size_t i = home(hash);; i = (i + 1) & (table.size() - 1)) {
+            if (table[i] == kEmpty) return nullptr;
+            const Entry& entry = ring[table[i]];
+            if (entry.keyHash == hash && entry.keyCheck == check) return &entry;
+        }
+    }
+
+    // Adds a key that find() didn't report; `recordedAt` must not go backwards between calls
+    void insert(const string& key, uint64_t request, time_t recordedAt) {
+        rotate(recordedAt);
+        uint64_t hash = std::hash<string>()(key);
+        filters[wordOf(hash) + current] |= probeMask(hash);
+
+        if (live == ring.size()) {
+            if (ring.size() < capacity) grow();
+            else forgetOldest();
+        }
+        uint32_t position = static_cast<uint32_t>((oldest + live) % ring.size());
+        ring[position] = Entry{ hash, checkHash(key), recordedAt, request };
+        ++live;
+        place(position);
+    }
+
+    size_t size() const { return live; }
+
+private:
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+
+    size_t capacity;
+    time_t ttlSeconds;
+    vector<uint64_t> filters;  // Word pairs: [2i + g] is word i of generation g
+    size_t current = 0;
+    time_t currentSince = 0;
+    vector<Entry> ring;        // live entries from `oldest`, wrapping around
+    size_t oldest = 0;
+    size_t live = 0;
+    vector<uint32_t> table;    // Ring positions; linear probing, at most half full
+
+    static uint64_t probeMask(uint64_t hash) {
+        return (uint64_t(1) << (hash & 63)) | (uint64_t(1) << ((hash >> 6) & 63)) | (uint64_t(1) << ((hash >> 12) & 63)) |
+               (uint64_t(1) << ((hash >> 18) & 63));
+    }
+
+    // FNV-1a, unrelated to std::hash, so the pair identifies a key with 128 bits
+    static uint64_t checkHash(const string& key) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key) hash = (hash ^ c) * 1099511628211ull;
+        return hash;
+    }
+
+    size_t wordOf(uint64_t hash) const { return ((hash >> 32) * 2) & (filters.size() - 1); }
+    size_t home(uint64_t hash) const { return (hash >> 24) & (table.size() - 1); }
+
+    void rotate(time_t now) {
+        if (now - currentSince < ttlSeconds) return;
+        current ^= 1;
+        for (size_t i = current; i < filters.size(); i += 2) filters[i] = 0;
+        currentSince = now;
+    }
+
+    void expire(time_t now) {
+        while (live && now - ring[oldest].recordedAt >= ttlSeconds) forgetOldest();
+    }
+
+    void place(uint32_t position) {
+        size_t i = home(ring[position].keyHash);
+        while (table[i] != kEmpty) i = (i + 1) & (table.size() - 1);
+        table[i] = position;
+    }
+
+    // Removes the oldest entry from the table, shifting later entries of its probe run back so
+    // that no tombstones are needed
+    void forgetOldest() {
+        size_t mask = table.size() - 1;
+        size_t hole = home(ring[oldest].keyHash);
+        while (table[hole] != oldest) hole = (hole + 1) & mask;
+        for (size_t next = (hole + 1) & mask; table[next] != kEmpty; next = (next + 1) & mask) {
+            size_t wanted = home(ring[table[next]].keyHash);
+            // Move it back unless its home lies cyclically in (hole, next]
+            if (((next - wanted) & mask) >= ((next - hole) & mask)) {
+                table[hole] = table[next];
+                hole = next;
+            }
+        }
+        table[hole] = kEmpty;
+        oldest = (oldest + 1) % ring.size();
+        --live;
+    }
+
+    // Doubles the ring (up to capacity), unwrapping it so the oldest entry comes first
+    void grow() {
+        vector<Entry> larger(min(capacity, max<size_t>(1024, ring.size() * 2)));
+        for (size_t i = 0; i < live; ++i) larger[i] = ring[(oldest + i) % ring.size()];
+        ring.swap(larger);
+        oldest = 0;
+        size_t slots = 2048;
+        while (slots < ring.size() * 2) slots *= 2;
+        table.assign(slots, kEmpty);
+        for (uint32_t position = 0; position < live; ++position) place(position);
+    }
+};
 
 // Bank class
 class Bank {
 private:
     vector<Account*> accounts;
     vector<Transaction*> transactions;
+    unordered_map<int, Account*> accountIndex;  // By account number, for the hot paths
+    map<string, EndOfDayRates> rates;  // Keyed by getAccountType()
+    string lastEndOfDay;               // Business date (YYYY-MM-DD) of the last end-of-day run
+    VelocityLimiter limiter;
+    size_t persistedLimits = 0;  // limit/ records in the store, numbered from 0
+    IdempotencyCache appliedRequests;
+    RecordStore store;
 
-    void saveData();
+    void addAccount(Account* account);
+    Account* findAccount(int accountNumber) const;
+    void commitPostings(size_t firstPosition, const vector<pair<Account*, double>>& balancesBefore);
+    void stageLimits();
+    void replaceLimits(const vector<VelocityRule>& rules);
+
+    // Retried requests: deposit, withdraw and transfer take an optional idempotency key, and a
+    // request whose key was applied within kIdempotencyTtl returns as it did the first time
+    // without being applied again. Only applied requests are remembered, so a request that
+    // failed (say, for insufficient funds) can be retried with the same key. The key is stored
+    // in the operation's (first) transaction record and the cache is rebuilt from those.
+    static constexpr size_t kIdempotencyCapacity = 1 << 20;
+    static constexpr time_t kIdempotencyTtl = 24 * 60 * 60;
+    static constexpr size_t kMaxIdempotencyKey = 256;
+    static uint64_t requestFingerprint(const char* operation, int account, int otherAccount, double amount);
+    bool alreadyApplied(const string& key, uint64_t request);
+    void loadAppliedRequests(const vector<string>& requestKeys);
+
+    // Balances of every account after transactions[0, position), sorted by account number.
+    // checkpoints[0] is where the recorded history starts; later ones are taken every
+    // max(kMinCheckpointInterval, accounts) postings, so the copying is amortized O(1) per
+    // posting and an as-of query replays at most one interval.
+    struct BalanceCheckpoint {
+        size_t position = 0;
+        time_t time = 0;  // Time of the last posting included (or when the history started)
+        vector<int> accountNumbers;
+        vector<double> balances;
+
+        const double* find(int accountNumber) const;
+    };
+    static constexpr size_t kMinCheckpointInterval = 1024;
+    vector<BalanceCheckpoint> checkpoints;
+    time_t lastPostingTime = 0;
+    vector<int> postingAccounts;  // Account and time of each entry in `transactions`, kept flat so
+    vector<time_t> postingTimes;  // replays scan contiguous memory instead of chasing pointers
+
+    time_t postingTime();
+    static string businessDate(time_t when);
+    void trackPostings();
+    static BalanceCheckpoint makeCheckpoint(size_t position, time_t time, vector<pair<int, double>> balances);
+    const BalanceCheckpoint& checkpointAsOf(time_t when) const;
+    void loadBalanceHistory();
+
+    void stageAccount(const Account* account);
+    void stageTransaction(size_t position, const string& idempotencyKey = "");
+    void stageRates(const string& accountType);
+    static void encodeAccount(string& frames, const Account* account);
+    static void encodeTransaction(string& frames, size_t position, const Transaction* transaction, const string& idempotencyKey = "");
+    void loadLegacyFiles();
     void loadData();
 
 public:
-    Bank() { loadData(); }
+    Bank() : appliedRequests(kIdempotencyCapacity, kIdempotencyTtl), store("bank") { loadData(); }
     ~Bank();
 
     void createAccount(Account* account);
-    void deposit(int accountNumber, double amount);
-    void withdraw(int accountNumber, double amount);
-    void transfer(int fromAccount, int toAccount, double amount);
-    void displayAccounts() const;
-    void displayTransactions() const;
+    void deposit(int accountNumber, double amount, const string& idempotencyKey = "");
+    void withdraw(int accountNumber, double amount, const string& idempotencyKey = "");
+    void transfer(int fromAccount, int toAccount, double amount, const string& idempotencyKey = "");
+    void displayAccounts(ostream& out = cout) const;
+    void displayTransactions(ostream& out = cout) const;
+
+    void setEndOfDayRates(const string& accountType, const EndOfDayRates& terms);
+    EndOfDayReport runEndOfDay();
+
+    void addVelocityRule(const VelocityRule& rule);
+    void clearVelocityRules();
+    const vector<VelocityRule>& velocityRules() const { return limiter.getRules(); }
+
+    // Balances as they stood at `when`, for times since the bank started recording history
+    double balanceAsOf(int accountNumber, time_t when) const;
+    vector<pair<int, double>> balancesAsOf(time_t when) const;
+
+    // With group commit on, operations are made durable together by flush() instead of one at
+    // a time; used by the scripted command mode, which flushes before sending any results.
+    void setGroupCommit(bool enabled) { store.setGroupCommit(enabled); }
+    void flush() { store.flush(); }
 };
 
 // Destructor to clean up dynamically allocated memory
@@ -128,93 +572,686 @@ Bank::~Bank() {
     for (size_t i = 0; i < transactions.size(); ++i) delete transactions[i];
 }
 
-// Create a new account
+// Same text as to_string(double) ("%f"), several times faster; it dominates bulk encoding.
+static string formatAmount(double amount) {
+    char buffer[64];
+    auto result = to_chars(buffer, buffer + sizeof(buffer), amount, chars_format::fixed, 6);
+    return string(buffer, result.ptr);
+}
+
+// Shortest text that reads back as exactly the same double, for rates and fees
+static string formatExact(double value) {
+    char buffer[64];
+    auto result = to_chars(buffer, buffer + sizeof(buffer), value);
+    return string(buffer, result.ptr);
+}
+
+static int64_t velocityClockMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Create a new account. The bank takes ownership only if the number is free.
 void Bank::createAccount(Account* account) {
+    static OperationMetric& metric = OperationStats::metric("bank.createAccount");
+    OperationTimer timer(metric);
+    if (findAccount(account->getAccountNumber())) throw runtime_error("Account number already exists.");
+    transactions.push_back(new Transaction(account->getAccountNumber(), "Opening", account->getBalance(), postingTime()));
+    stageAccount(account);
+    stageTransaction(transactions.size() - 1);
+    commitPostings(transactions.size() - 1, {});
+    addAccount(account);
+    trackPostings();
+}
+
+// Commits the staged records of an operation whose postings start at transactions[firstPosition].
+// A failed commit is discarded by the store, so the operation's postings and balance changes
+// are undone here too, and memory keeps matching what is durable.
+void Bank::commitPostings(size_t firstPosition, const vector<pair<Account*, double>>& balancesBefore) {
+    try {
+        store.commit();
+    } catch (const exception&) {
+        for (const auto& entry : balancesBefore) entry.first->restoreBalance(entry.second);
+        for (size_t i = firstPosition; i < transactions.size(); ++i) delete transactions[i];
+        transactions.resize(firstPosition);
+        throw;
+    }
+}
+
+void Bank::addAccount(Account* account) {
     accounts.push_back(account);
-    saveData();
+    accountIndex.emplace(account->getAccountNumber(), account);  // The first account with a number wins, as the scans did
+}
+
+Account* Bank::findAccount(int accountNumber) const {
+    auto it = accountIndex.find(accountNumber);
+    return it == accountIndex.end() ? nullptr : it->second;
 }
 
 // Deposit money into an account
-void Bank::deposit(int accountNumber, double amount) {
-    for (size_t i = 0; i < accounts.size(); ++i) {
-        if (accounts[i]->getAccountNumber() == accountNumber) {
-            accounts[i]->deposit(amount);
-            transactions.push_back(new Transaction(accountNumber, "Deposit", amount));
-            saveData();
-            return;
-        }
+void Bank::deposit(int accountNumber, double amount, const string& idempotencyKey) {
+    static OperationMetric& metric = OperationStats::metric("bank.deposit");
+    OperationTimer timer(metric);
+    uint64_t request = 0;
+    if (!idempotencyKey.empty()) {
+        request = requestFingerprint("deposit", accountNumber, 0, amount);
+        if (alreadyApplied(idempotencyKey, request)) return;
     }
-    throw runtime_error("Account not found.");
+    Account* account = findAccount(accountNumber);
+    if (!account) throw runtime_error("Account not found.");
+    double balanceBefore = account->getBalance();
+    account->deposit(amount);
+    transactions.push_back(new Transaction(accountNumber, "Deposit", amount, postingTime()));
+    stageAccount(account);
+    stageTransaction(transactions.size() - 1, idempotencyKey);
+    commitPostings(transactions.size() - 1, { { account, balanceBefore } });
+    if (!idempotencyKey.empty()) appliedRequests.insert(idempotencyKey, request, transactions.back()->getTime());
+    trackPostings();
 }
 
 // Withdraw money from an account
-void Bank::withdraw(int accountNumber, double amount) {
-    for (size_t i = 0; i < accounts.size(); ++i) {
-        if (accounts[i]->getAccountNumber() == accountNumber) {
-            accounts[i]->withdraw(amount);
-            transactions.push_back(new Transaction(accountNumber, "Withdrawal", amount));
-            saveData();
-            return;
-        }
+void Bank::withdraw(int accountNumber, double amount, const string& idempotencyKey) {
+    static OperationMetric& metric = OperationStats::metric("bank.withdraw");
+    OperationTimer timer(metric);
+    uint64_t request = 0;
+    if (!idempotencyKey.empty()) {
+        request = requestFingerprint("withdraw", accountNumber, 0, amount);
+        if (alreadyApplied(idempotencyKey, request)) return;
     }
-    throw runtime_error("Account not found.");
+    Account* account = findAccount(accountNumber);
+    if (!account) throw runtime_error("Account not found.");
+    int64_t now = velocityClockMs();
+    if (const char* violation = limiter.check(accountNumber, VelocityRule::Withdrawals, amount, now)) {
+        throw runtime_error(string("Velocity limit exceeded: ") + violation + ".");
+    }
+    double balanceBefore = account->getBalance();
+    account->withdraw(amount);
+    transactions.push_back(new Transaction(accountNumber, "Withdrawal", amount, postingTime()));
+    stageAccount(account);
+    stageTransaction(transactions.size() - 1, idempotencyKey);
+    commitPostings(transactions.size() - 1, { { account, balanceBefore } });
+    limiter.record(accountNumber, VelocityRule::Withdrawals, amount, now);
+    if (!idempotencyKey.empty()) appliedRequests.insert(idempotencyKey, request, transactions.back()->getTime());
+    trackPostings();
 }
 
 // Transfer money between accounts
-void Bank::transfer(int fromAccount, int toAccount, double amount) {
-    Account* from = nullptr;
-    Account* to = nullptr;
-
-    for (size_t i = 0; i < accounts.size(); ++i) {
-        if (accounts[i]->getAccountNumber() == fromAccount) {
-            from = accounts[i];
-        }
-        if (accounts[i]->getAccountNumber() == toAccount) {
-            to = accounts[i];
-        }
+void Bank::transfer(int fromAccount, int toAccount, double amount, const string& idempotencyKey) {
+    static OperationMetric& metric = OperationStats::metric("bank.transfer");
+    OperationTimer timer(metric);
+    uint64_t request = 0;
+    if (!idempotencyKey.empty()) {
+        request = requestFingerprint("transfer", fromAccount, toAccount, amount);
+        if (alreadyApplied(idempotencyKey, request)) return;
     }
+    Account* from = findAccount(fromAccount);
+    Account* to = findAccount(toAccount);
 
     if (!from) throw runtime_error("From account not found.");
     if (!to) throw runtime_error("To account not found.");
 
+    int64_t now = velocityClockMs();
+    if (const char* violation = limiter.check(fromAccount, VelocityRule::Transfers, amount, now)) {
+        throw runtime_error(string("Velocity limit exceeded: ") + violation + ".");
+    }
+    vector<pair<Account*, double>> balancesBefore = { { from, from->getBalance() }, { to, to->getBalance() } };
     from->withdraw(amount);
     to->deposit(amount);
 
-    transactions.push_back(new Transaction(fromAccount, "Transfer Out", amount));
-    transactions.push_back(new Transaction(toAccount, "Transfer In", amount));
-    saveData();
+    time_t postedAt = postingTime();
+    transactions.push_back(new Transaction(fromAccount, "Transfer Out", amount, postedAt));
+    transactions.push_back(new Transaction(toAccount, "Transfer In", amount, postedAt));
+
+    // Both legs go into one commit, so a crash can never persist half a transfer.
+    stageAccount(from);
+    stageAccount(to);
+    stageTransaction(transactions.size() - 2, idempotencyKey);
+    stageTransaction(transactions.size() - 1);
+    commitPostings(transactions.size() - 2, balancesBefore);
+    limiter.record(fromAccount, VelocityRule::Transfers, amount, now);
+    if (!idempotencyKey.empty()) appliedRequests.insert(idempotencyKey, request, postedAt);
+    trackPostings();
+}
+
+// FNV-1a over the operation's name and arguments. The amount is hashed as it is stored, so a
+// fingerprint recomputed from a reloaded transaction matches the original request's.
+uint64_t Bank::requestFingerprint(const char* operation, int account, int otherAccount, double amount) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 1099511628211ull;
+    };
+    string storedAmount = formatAmount(amount);
+    mix(operation, strlen(operation));
+    mix(&account, sizeof(account));
+    mix(&otherAccount, sizeof(otherAccount));
+    mix(storedAmount.data(), storedAmount.size());
+    return hash;
+}
+
+bool Bank::alreadyApplied(const string& key, uint64_t request) {
+    static OperationMetric& replays = OperationStats::metric("bank.idempotentReplay");
+    if (key.size() > kMaxIdempotencyKey) throw runtime_error("Idempotency key too long.");
+    const IdempotencyCache::Entry* entry = appliedRequests.find(key, time(nullptr));
+    if (!entry) return false;
+    if (entry->request != request) throw runtime_error("Idempotency key already used for a different request.");
+    OperationTimer timer(replays);
+    return true;
+}
+
+// Rebuilds the cache from the keys stored with the transactions (requestKeys[i] belongs to
+// transactions[i]), recomputing each fingerprint from the postings.
+void Bank::loadAppliedRequests(const vector<string>& requestKeys) {
+    time_t now = time(nullptr);
+    for (size_t i = 0; i < requestKeys.size(); ++i) {
+        const Transaction* transaction = transactions[i];
+        if (requestKeys[i].empty() || now - transaction->getTime() >= kIdempotencyTtl) continue;
+        uint64_t request;
+        if (transaction->getType() == "Deposit") {
+            request = requestFingerprint("deposit", transaction->getAccountNumber(), 0, transaction->getAmount());
+        } else if (transaction->getType() == "Withdrawal") {
+            request = requestFingerprint("withdraw", transaction->getAccountNumber(), 0, transaction->getAmount());
+        } else if (transaction->getType() == "Transfer Out" && i + 1 < transactions.size()) {
+            request = requestFingerprint("transfer", transaction->getAccountNumber(), transactions[i + 1]->getAccountNumber(), transaction->getAmount());
+        } else {
+            continue;
+        }
+        appliedRequests.insert(requestKeys[i], request, transaction->getTime());
+    }
 }
 
 // Display all accounts
-void Bank::displayAccounts() const {
+void Bank::displayAccounts(ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("bank.displayAccounts");
+    OperationTimer timer(metric);
     for (size_t i = 0; i < accounts.size(); ++i) {
-        accounts[i]->display();
+        accounts[i]->display(out);
     }
 }
 
 // Display all transactions
-void Bank::displayTransactions() const {
+void Bank::displayTransactions(ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("bank.displayTransactions");
+    OperationTimer timer(metric);
     for (size_t i = 0; i < transactions.size(); ++i) {
-        transactions[i]->display();
+        transactions[i]->display(out);
     }
 }
 
-// Save data to a file
-void Bank::saveData() {
-    ofstream accountFile("accounts.txt");
-    ofstream transactionFile("transactions.txt");
+void Bank::addVelocityRule(const VelocityRule& rule) {
+    if (rule.windowSeconds <= 0) throw runtime_error("Window must be positive.");
+    if (rule.maxAmount < 0) throw runtime_error("Limit must not be negative.");
+    if (!rule.maxCount && rule.maxAmount == 0) throw runtime_error("Rule sets no limit.");
+    vector<VelocityRule> rules = limiter.getRules();
+    rules.push_back(rule);
+    replaceLimits(rules);
+}
 
-    for (size_t i = 0; i < accounts.size(); ++i) {
-        accountFile << accounts[i]->getAccountNumber() << "|" << accounts[i]->getBalance() << "|" << accounts[i]->getAccountType() << endl;
+void Bank::clearVelocityRules() {
+    replaceLimits(vector<VelocityRule>());
+}
+
+// Installs `rules` and persists them; a failed commit leaves the previous rules in place.
+void Bank::replaceLimits(const vector<VelocityRule>& rules) {
+    vector<VelocityRule> previous = limiter.getRules();
+    size_t persistedBefore = persistedLimits;
+    limiter.setRules(rules);
+    stageLimits();
+    try {
+        store.commit();
+    } catch (const exception&) {
+        limiter.setRules(previous);
+        persistedLimits = persistedBefore;
+        throw;
     }
+}
 
-    for (size_t i = 0; i < transactions.size(); ++i) {
-        transactionFile << transactions[i]->getAccountNumber() << "|" << transactions[i]->getType() << "|" << transactions[i]->getAmount() << endl;
+void Bank::setEndOfDayRates(const string& accountType, const EndOfDayRates& terms) {
+    if (accountType != "Savings" && accountType != "Current") throw runtime_error("Unknown account type.");
+    if (terms.annualInterestRate < 0 || terms.dailyFee < 0) throw runtime_error("Rates must not be negative.");
+    auto existing = rates.find(accountType);
+    optional<EndOfDayRates> previous;
+    if (existing != rates.end()) previous = existing->second;
+    rates[accountType] = terms;
+    stageRates(accountType);
+    try {
+        store.commit();
+    } catch (const exception&) {
+        if (previous) rates[accountType] = *previous;
+        else rates.erase(accountType);
+        throw;
+    }
+}
+
+// Applies a day of interest and fees to every account, as a single commit. The accounts are
+// split into one contiguous range per core. Each worker first gathers its balances and terms
+// into flat arrays and computes the postings over them; after the ranges' transaction numbers
+// are assigned, each worker applies its postings and encodes its records in parallel, so only
+// the final append of the encoded buffers is serial. A day is only run once: its business date
+// is committed with the postings, and a later run for the same date is rejected.
+EndOfDayReport Bank::runEndOfDay() {
+    static OperationMetric& metric = OperationStats::metric("bank.endOfDay");
+    OperationTimer timer(metric);
+    auto start = chrono::steady_clock::now();
+    time_t postedAt = postingTime();
+    string date = businessDate(postedAt);
+    if (date <= lastEndOfDay) throw runtime_error("End of day has already run for " + lastEndOfDay + ".");
+
+    size_t n = accounts.size();
+    vector<double> balances(n);
+    vector<double> dailyRates(n);
+    vector<double> fees(n);
+    vector<double> interest(n);
+    vector<double> charged(n);
+
+    struct Range {
+        size_t first, last;
+        size_t postings = 0;
+        size_t firstPosition = 0;  // Index in `transactions` of this range's first posting
+        EndOfDayReport totals;
+        string frames;
+    };
+    size_t workers = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), n / 4096 + 1));
+    size_t chunk = (n + workers - 1) / workers;
+    vector<Range> ranges(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        ranges[w].first = min(n, w * chunk);
+        ranges[w].last = min(n, ranges[w].first + chunk);
+    }
+
+    // A worker's exception is rethrown here once every worker has finished
+    auto runOnRanges = [&](const function<void(Range&)>& work) {
+        vector<exception_ptr> errors(ranges.size());
+        vector<thread> threads;
+        for (size_t w = 0; w < ranges.size(); ++w) {
+            threads.emplace_back([&, w] {
+                try {
+                    work(ranges[w]);
+                } catch (...) {
+                    errors[w] = current_exception();
+                }
+            });
+        }
+        for (auto& worker : threads) worker.join();
+        for (const exception_ptr& error : errors) {
+            if (error) rethrow_exception(error);
+        }
+    };
+
+    runOnRanges([&](Range& range) {
+        for (size_t i = range.first; i < range.last; ++i) {
+            auto it = rates.find(accounts[i]->getAccountType());
+            balances[i] = accounts[i]->getBalance();
+            dailyRates[i] = it == rates.end() ? 0 : it->second.annualInterestRate / 365;
+            fees[i] = it == rates.end() ? 0 : it->second.dailyFee;
+        }
+        // Amounts are rounded to cents so postings match what a statement would show. A fee
+        // never exceeds the balance the withdrawal will see: flooring to cents can still round
+        // up (0.19999999999999998 * 100 is 20.0), so that case drops to the cent below.
+        for (size_t i = range.first; i < range.last; ++i) {
+            double earned = balances[i] > 0 ? round(balances[i] * dailyRates[i] * 100) / 100 : 0;
+            double balance = max(balances[i] + earned, 0.0);  // As deposit() will leave it
+            double available = floor(balance * 100) / 100;
+            if (available > balance) available = (floor(balance * 100) - 1) / 100;
+            interest[i] = earned;
+            charged[i] = min(round(fees[i] * 100) / 100, available);
+            range.postings += (interest[i] > 0) + (charged[i] > 0);
+        }
+    });
+
+    size_t position = transactions.size();
+    for (Range& range : ranges) {
+        range.firstPosition = position;
+        position += range.postings;
+    }
+    transactions.resize(position);
+
+    runOnRanges([&](Range& range) {
+        size_t next = range.firstPosition;
+        for (size_t i = range.first; i < range.last; ++i) {
+            if (interest[i] <= 0 && charged[i] <= 0) continue;
+            int accountNumber = accounts[i]->getAccountNumber();
+            if (interest[i] > 0) {
+                accounts[i]->deposit(interest[i]);
+                transactions[next] = new Transaction(accountNumber, "Interest", interest[i], postedAt);
+                encodeTransaction(range.frames, next, transactions[next]);
+                ++next;
+                ++range.totals.interestPostings;
+                range.totals.interestPaid += interest[i];
+            }
+            if (charged[i] > 0) {
+                accounts[i]->withdraw(charged[i]);
+                transactions[next] = new Transaction(accountNumber, "Fee", charged[i], postedAt);
+                encodeTransaction(range.frames, next, transactions[next]);
+                ++next;
+                ++range.totals.feePostings;
+                range.totals.feesCharged += charged[i];
+            }
+            encodeAccount(range.frames, accounts[i]);
+        }
+    });
+
+    EndOfDayReport report;
+    report.accounts = n;
+    for (Range& range : ranges) {
+        store.stageEncoded(range.frames);
+        string().swap(range.frames);
+        report.interestPostings += range.totals.interestPostings;
+        report.feePostings += range.totals.feePostings;
+        report.interestPaid += range.totals.interestPaid;
+        report.feesCharged += range.totals.feesCharged;
+    }
+    store.put("endofday/last", date);
+    try {
+        store.commit();
+    } catch (const exception&) {
+        for (size_t i = 0; i < n; ++i) accounts[i]->restoreBalance(balances[i]);
+        for (size_t i = ranges.front().firstPosition; i < transactions.size(); ++i) delete transactions[i];
+        transactions.resize(ranges.front().firstPosition);
+        throw;
+    }
+    lastEndOfDay = date;
+    trackPostings();
+
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+// Postings are stamped with non-decreasing times, which lets a checkpoint stand for
+// "everything posted up to its time".
+time_t Bank::postingTime() {
+    lastPostingTime = max(lastPostingTime, time(nullptr));
+    return lastPostingTime;
+}
+
+string Bank::businessDate(time_t when) {
+    char buffer[16];
+    tm local;
+    localtime_r(&when, &local);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d", &local);
+    return buffer;
+}
+
+const double* Bank::BalanceCheckpoint::find(int accountNumber) const {
+    auto it = lower_bound(accountNumbers.begin(), accountNumbers.end(), accountNumber);
+    if (it == accountNumbers.end() || *it != accountNumber) return nullptr;
+    return &balances[it - accountNumbers.begin()];
+}
+
+Bank::BalanceCheckpoint Bank::makeCheckpoint(size_t position, time_t time, vector<pair<int, double>> balances) {
+    sort(balances.begin(), balances.end());
+    BalanceCheckpoint checkpoint;
+    checkpoint.position = position;
+    checkpoint.time = time;
+    checkpoint.accountNumbers.reserve(balances.size());
+    checkpoint.balances.reserve(balances.size());
+    for (const auto& entry : balances) {
+        checkpoint.accountNumbers.push_back(entry.first);
+        checkpoint.balances.push_back(entry.second);
+    }
+    return checkpoint;
+}
+
+// Called after every commit that posts transactions: indexes the new postings and takes a
+// checkpoint when one is due.
+void Bank::trackPostings() {
+    for (size_t i = postingAccounts.size(); i < transactions.size(); ++i) {
+        postingAccounts.push_back(transactions[i]->getAccountNumber());
+        postingTimes.push_back(transactions[i]->getTime());
+    }
+    if (transactions.size() - checkpoints.back().position < max(kMinCheckpointInterval, accountIndex.size())) return;
+    vector<pair<int, double>> balances;
+    balances.reserve(accountIndex.size());
+    for (const auto& entry : accountIndex) balances.emplace_back(entry.first, entry.second->getBalance());
+    checkpoints.push_back(makeCheckpoint(transactions.size(), lastPostingTime, move(balances)));
+}
+
+const Bank::BalanceCheckpoint& Bank::checkpointAsOf(time_t when) const {
+    if (when < checkpoints.front().time) throw runtime_error("No balance history before " + to_string(checkpoints.front().time) + ".");
+    auto it = upper_bound(checkpoints.begin(), checkpoints.end(), when,
+                          [](time_t t, const BalanceCheckpoint& checkpoint) { return t < checkpoint.time; });
+    return *(it - 1);
+}
+
+// One checkpoint lookup plus a replay of the account's postings after it
+double Bank::balanceAsOf(int accountNumber, time_t when) const {
+    static OperationMetric& metric = OperationStats::metric("bank.balanceAsOf");
+    OperationTimer timer(metric);
+    const BalanceCheckpoint& checkpoint = checkpointAsOf(when);
+    const double* start = checkpoint.find(accountNumber);
+    bool opened = start != nullptr;
+    double balance = start ? *start : 0;
+    size_t replayEnd = upper_bound(postingTimes.begin() + checkpoint.position, postingTimes.end(), when) - postingTimes.begin();
+    for (size_t i = checkpoint.position; i < replayEnd; ++i) {
+        if (postingAccounts[i] != accountNumber) continue;
+        opened = true;
+        balance += transactions[i]->balanceEffect();
+    }
+    if (!opened) throw runtime_error("Account not found at that time.");
+    return balance;
+}
+
+// The whole bank at `when`, sorted by account number. Accounts are split into one contiguous
+// range per core; each worker copies its range from the checkpoint and applies the replayed
+// postings that fall in it.
+vector<pair<int, double>> Bank::balancesAsOf(time_t when) const {
+    static OperationMetric& metric = OperationStats::metric("bank.balancesAsOf");
+    OperationTimer timer(metric);
+    const BalanceCheckpoint& checkpoint = checkpointAsOf(when);
+    size_t replayEnd = upper_bound(postingTimes.begin() + checkpoint.position, postingTimes.end(), when) - postingTimes.begin();
+
+    // Accounts opened during the replay aren't in the checkpoint
+    vector<int> numbers = checkpoint.accountNumbers;
+    for (size_t i = checkpoint.position; i < replayEnd; ++i) {
+        if (!checkpoint.find(postingAccounts[i])) numbers.push_back(postingAccounts[i]);
+    }
+    sort(numbers.begin() + checkpoint.accountNumbers.size(), numbers.end());
+    inplace_merge(numbers.begin(), numbers.begin() + checkpoint.accountNumbers.size(), numbers.end());
+    numbers.erase(unique(numbers.begin(), numbers.end()), numbers.end());
+
+    size_t n = numbers.size();
+    vector<pair<int, double>> result(n);
+    size_t workers = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), n / 4096 + 1));
+    size_t chunk = (n + workers - 1) / workers;
+    vector<thread> threads;
+    for (size_t w = 0; w < workers; ++w) {
+        size_t first = min(n, w * chunk);
+        size_t last = min(n, first + chunk);
+        if (first == last) continue;
+        threads.emplace_back([&, first, last]() {
+            for (size_t i = first; i < last; ++i) {
+                const double* start = checkpoint.find(numbers[i]);
+                result[i] = make_pair(numbers[i], start ? *start : 0.0);
+            }
+            int low = numbers[first];
+            int high = numbers[last - 1];
+            for (size_t t = checkpoint.position; t < replayEnd; ++t) {
+                int accountNumber = postingAccounts[t];
+                if (accountNumber < low || accountNumber > high) continue;
+                size_t i = lower_bound(numbers.begin() + first, numbers.begin() + last, accountNumber) - numbers.begin();
+                result[i].second += transactions[t]->balanceEffect();
+            }
+        });
+    }
+    for (auto& worker : threads) worker.join();
+    return result;
+}
+
+// Rebuilds the checkpoints from the ledger. The first load of a store that has no recorded
+// starting point (a legacy import, or data from before balance history existed) starts the
+// history at the current balances and persists that as asof/base.
+void Bank::loadBalanceHistory() {
+    // Entries from before timestamps existed read as 0; clamping keeps postingTimes sorted
+    for (const Transaction* transaction : transactions) {
+        lastPostingTime = max(lastPostingTime, transaction->getTime());
+        postingAccounts.push_back(transaction->getAccountNumber());
+        postingTimes.push_back(lastPostingTime);
+    }
+
+    string base;
+    if (!store.get("asof/base", base)) {
+        vector<pair<int, double>> balances;
+        for (const auto& entry : accountIndex) balances.emplace_back(entry.first, entry.second->getBalance());
+        checkpoints.push_back(makeCheckpoint(transactions.size(), postingTime(), move(balances)));
+
+        const BalanceCheckpoint& first = checkpoints.front();
+        string value = to_string(first.position) + "|" + to_string(first.time) + "|";
+        for (size_t i = 0; i < first.accountNumbers.size(); ++i) {
+            value += to_string(first.accountNumbers[i]) + ":" + formatAmount(first.balances[i]) + ";";
+        }
+        store.put("asof/base", value);
+        store.commit();
+        return;
+    }
+
+    istringstream fields(base);
+    string position, startTime, entry;
+    getline(fields, position, '|');
+    getline(fields, startTime, '|');
+    vector<pair<int, double>> balances;
+    while (getline(fields, entry, ';')) {
+        size_t colon = entry.find(':');
+        balances.emplace_back(stoi(entry.substr(0, colon)), stod(entry.substr(colon + 1)));
     }
+    checkpoints.push_back(makeCheckpoint(stoull(position), stoll(startTime), balances));
+    lastPostingTime = max(lastPostingTime, checkpoints.front().time);
+
+    // Stamped with the clamped posting times, as trackPostings() stamps them live. Postings
+    // made after the base was taken were clamped to its time too.
+    unordered_map<int, double> running(balances.begin(), balances.end());
+    for (size_t i = checkpoints.front().position; i < transactions.size(); ++i) {
+        postingTimes[i] = max(postingTimes[i], checkpoints.front().time);
+        running[transactions[i]->getAccountNumber()] += transactions[i]->balanceEffect();
+        size_t sinceLast = i + 1 - checkpoints.back().position;
+        if (sinceLast >= max(kMinCheckpointInterval, running.size())) {
+            checkpoints.push_back(makeCheckpoint(i + 1, postingTimes[i], vector<pair<int, double>>(running.begin(), running.end())));
+        }
+    }
+}
+
+// Records are stored in the same pipe-delimited form the text files used:
+//   account/<number>      -> balance|type
+//   transaction/<sequence> -> account|type|amount|time[|idempotencyKey]   (sequence is zero-padded to keep key order)
+//   rates/<type>          -> annualInterestRate|dailyFee
+//   limit/<index>         -> scope|windowSeconds|maxCount|maxAmount
+//   asof/base             -> position|time|account:balance;...   (where balance history starts)
+void Bank::stageAccount(const Account* account) {
+    string frames;
+    encodeAccount(frames, account);
+    store.stageEncoded(frames);
+}
+
+void Bank::stageTransaction(size_t position, const string& idempotencyKey) {
+    string frames;
+    encodeTransaction(frames, position, transactions[position], idempotencyKey);
+    store.stageEncoded(frames);
+}
+
+// Static so the end-of-day run can encode records on its worker threads
+void Bank::encodeAccount(string& frames, const Account* account) {
+    RecordStore::encodePut(frames, "account/" + to_string(account->getAccountNumber()),
+                           formatAmount(account->getBalance()) + "|" + account->getAccountType());
+}
+
+void Bank::encodeTransaction(string& frames, size_t position, const Transaction* transaction, const string& idempotencyKey) {
+    string sequence = to_string(position);
+    string key = "transaction/" + string(sequence.size() < 12 ? 12 - sequence.size() : 0, '0') + sequence;
+    RecordStore::encodePut(frames, key, to_string(transaction->getAccountNumber()) + "|" + transaction->getType() + "|" + formatAmount(transaction->getAmount()) +
+                                        "|" + to_string(transaction->getTime()) + (idempotencyKey.empty() ? "" : "|" + idempotencyKey));
+}
+
+void Bank::stageRates(const string& accountType) {
+    const EndOfDayRates& terms = rates[accountType];
+    store.put("rates/" + accountType, formatExact(terms.annualInterestRate) + "|" + formatExact(terms.dailyFee));
+}
+
+// Rewrites the limit/ records to match the limiter's current rules. The records left over from
+// a longer rule set are found from persistedLimits rather than the store's index, which doesn't
+// yet include transactions waiting for a group commit.
+void Bank::stageLimits() {
+    auto limitKey = [](size_t i) {
+        string index = to_string(i);
+        return "limit/" + string(index.size() < 4 ? 4 - index.size() : 0, '0') + index;
+    };
+    const vector<VelocityRule>& rules = limiter.getRules();
+    for (size_t i = 0; i < rules.size(); ++i) {
+        store.put(limitKey(i), to_string(rules[i].scope) + "|" + to_string(rules[i].windowSeconds) + "|" + to_string(rules[i].maxCount) + "|" + formatAmount(rules[i].maxAmount));
+    }
+    for (size_t i = rules.size(); i < persistedLimits; ++i) store.erase(limitKey(i));
+    persistedLimits = rules.size();
 }
 
-// Load data from a file
+// Load data from the record store, importing the old text files the first time it is used
 void Bank::loadData() {
+    static OperationMetric& metric = OperationStats::metric("bank.loadData");
+    OperationTimer timer(metric);
+    const RecordStore::RecoveryStats& stats = store.recoveryStats();
+    if (stats.bytesDiscarded || stats.corruptPages) {
+        cerr << "Warning: recovered bank store, discarded " << stats.bytesDiscarded << " bytes of incomplete log and "
+             << stats.corruptPages << " corrupt pages" << endl;
+    }
+
+    if (store.empty()) {
+        loadLegacyFiles();
+        loadBalanceHistory();
+        return;
+    }
+
+    store.forEachPrefix("account/", [this](const string& key, const string& value) {
+        int accNum = stoi(key.substr(key.find('/') + 1));
+        size_t bar = value.find('|');
+        double bal = stod(value.substr(0, bar));
+        string type = value.substr(bar + 1);
+        if (type == "Savings") {
+            addAccount(new SavingsAccount(accNum, bal));
+        } else if (type == "Current") {
+            addAccount(new CurrentAccount(accNum, bal));
+        }
+    });
+
+    vector<string> requestKeys;
+    store.forEachPrefix("transaction/", [this, &requestKeys](const string&, const string& value) {
+        istringstream fields(value);
+        string accNum, type, amount, postedAt, requestKey;
+        getline(fields, accNum, '|');
+        getline(fields, type, '|');
+        getline(fields, amount, '|');
+        getline(fields, postedAt, '|');  // Absent in records written before postings were timestamped
+        getline(fields, requestKey);
+        transactions.push_back(new Transaction(stoi(accNum), type, stod(amount), postedAt.empty() ? 0 : stoll(postedAt)));
+        requestKeys.push_back(requestKey);
+    });
+    loadAppliedRequests(requestKeys);
+
+    store.forEachPrefix("rates/", [this](const string& key, const string& value) {
+        size_t bar = value.find('|');
+        EndOfDayRates& terms = rates[key.substr(key.find('/') + 1)];
+        terms.annualInterestRate = stod(value.substr(0, bar));
+        terms.dailyFee = stod(value.substr(bar + 1));
+    });
+    store.get("endofday/last", lastEndOfDay);
+
+    vector<VelocityRule> rules;
+    store.forEachPrefix("limit/", [this, &rules](const string& key, const string& value) {
+        persistedLimits = max<size_t>(persistedLimits, stoul(key.substr(key.find('/') + 1)) + 1);
+        istringstream fields(value);
+        string scope, window, count, amount;
+        getline(fields, scope, '|');
+        getline(fields, window, '|');
+        getline(fields, count, '|');
+        getline(fields, amount);
+        VelocityRule rule;
+        rule.scope = static_cast<VelocityRule::Scope>(stoi(scope));
+        rule.windowSeconds = stoi(window);
+        rule.maxCount = stoul(count);
+        rule.maxAmount = stod(amount);
+        rules.push_back(rule);
+    });
+    limiter.setRules(rules);
+
+    loadBalanceHistory();
+}
+
+// Import accounts.txt and transactions.txt into an empty store
+void Bank::loadLegacyFiles() {
     ifstream accountFile("accounts.txt");
     ifstream transactionFile("transactions.txt");
 
@@ -227,6 +1264,7 @@ void Bank::loadData() {
         accountFile >> bal;
         accountFile.ignore();
         getline(accountFile, type);
+        if (!type.empty() && type.back() == '\r') type.pop_back();
 
         Account* account = nullptr;
         if (type == "Savings") {
@@ -234,7 +1272,10 @@ void Bank::loadData() {
         } else if (type == "Current") {
             account = new CurrentAccount(accNum, bal);
         }
-        if (account) createAccount(account);
+        if (account) {
+            addAccount(account);
+            stageAccount(account);
+        }
     }
 
     int tAccNum;
@@ -248,7 +1289,132 @@ void Bank::loadData() {
         transactionFile.ignore();
 
         transactions.push_back(new Transaction(tAccNum, tType, tAmount));
+        stageTransaction(transactions.size() - 1);
+    }
+
+    store.commit();
+}
+
+// Accepts epoch seconds or a local "YYYY-MM-DD" / "YYYY-MM-DDTHH:MM:SS" time
+time_t parseAsOfTime(const string& text) {
+    if (!text.empty() && text.find_first_not_of("0123456789") == string::npos) return stoll(text);
+    tm fields = {};
+    istringstream in(text);
+    in >> get_time(&fields, text.size() > 10 ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d");
+    if (in.fail()) throw runtime_error("Invalid time: " + text);
+    if (text.size() <= 10) fields.tm_hour = 23, fields.tm_min = 59, fields.tm_sec = 59;  // A date means its end of day
+    fields.tm_isdst = -1;
+    return mktime(&fields);
+}
+
+// Commands for the scripted mode, e.g. "deposit 100500101 250"
+void registerCommands(CommandProcessor& commands, Bank& bank) {
+    commands.add("create", "<account> <balance> <savings|current>", 3, [&bank](const vector<string>& args, ostream&) {
+        int num = CommandProcessor::toInt(args[0]);
+        double bal = CommandProcessor::toDouble(args[1]);
+        Account* account = nullptr;
+        if (args[2] == "savings") account = new SavingsAccount(num, bal);
+        else if (args[2] == "current") account = new CurrentAccount(num, bal);
+        else throw runtime_error("Invalid type.");
+        try {
+            bank.createAccount(account);
+        } catch (...) {
+            delete account;
+            throw;
+        }
+    });
+    // The optional key makes a retry safe: a repeated key answers OK without posting again
+    commands.add("deposit", "<account> <amount> [idempotency-key]", 2, 3, [&bank](const vector<string>& args, ostream&) {
+        bank.deposit(CommandProcessor::toInt(args[0]), CommandProcessor::toDouble(args[1]), args.size() > 2 ? args[2] : "");
+    });
+    commands.add("withdraw", "<account> <amount> [idempotency-key]", 2, 3, [&bank](const vector<string>& args, ostream&) {
+        bank.withdraw(CommandProcessor::toInt(args[0]), CommandProcessor::toDouble(args[1]), args.size() > 2 ? args[2] : "");
+    });
+    commands.add("transfer", "<from> <to> <amount> [idempotency-key]", 3, 4, [&bank](const vector<string>& args, ostream&) {
+        bank.transfer(CommandProcessor::toInt(args[0]), CommandProcessor::toInt(args[1]), CommandProcessor::toDouble(args[2]),
+                      args.size() > 3 ? args[3] : "");
+    });
+    commands.add("accounts", "", 0, [&bank](const vector<string>&, ostream& out) { bank.displayAccounts(out); });
+    commands.add("transactions", "", 0, [&bank](const vector<string>&, ostream& out) { bank.displayTransactions(out); });
+    commands.add("set-rates", "<savings|current> <annual-interest-rate> <daily-fee>", 3, [&bank](const vector<string>& args, ostream&) {
+        EndOfDayRates terms;
+        terms.annualInterestRate = CommandProcessor::toDouble(args[1]);
+        terms.dailyFee = CommandProcessor::toDouble(args[2]);
+        if (args[0] == "savings") bank.setEndOfDayRates("Savings", terms);
+        else if (args[0] == "current") bank.setEndOfDayRates("Current", terms);
+        else throw runtime_error("Invalid account type: " + args[0]);
+    });
+    commands.add("end-of-day", "", 0, [&bank](const vector<string>&, ostream& out) {
+        EndOfDayReport report = bank.runEndOfDay();
+        out << "accounts " << report.accounts << " interest-postings " << report.interestPostings << " interest-paid " << report.interestPaid
+            << " fee-postings " << report.feePostings << " fees-charged " << report.feesCharged << " seconds " << report.seconds << '\n';
+    });
+    commands.add("add-limit", "<withdrawals|transfers|debits> <window-seconds> <max-count> <max-amount>", 4, [&bank](const vector<string>& args, ostream&) {
+        VelocityRule rule;
+        if (args[0] == "withdrawals") rule.scope = VelocityRule::Withdrawals;
+        else if (args[0] == "transfers") rule.scope = VelocityRule::Transfers;
+        else if (args[0] == "debits") rule.scope = VelocityRule::AllDebits;
+        else throw runtime_error("Invalid scope: " + args[0]);
+        rule.windowSeconds = CommandProcessor::toInt(args[1]);
+        int maxCount = CommandProcessor::toInt(args[2]);
+        if (maxCount < 0) throw runtime_error("Limit must not be negative.");
+        rule.maxCount = maxCount;
+        rule.maxAmount = CommandProcessor::toDouble(args[3]);
+        bank.addVelocityRule(rule);
+    });
+    commands.add("clear-limits", "", 0, [&bank](const vector<string>&, ostream&) { bank.clearVelocityRules(); });
+    commands.add("limits", "", 0, [&bank](const vector<string>&, ostream& out) {
+        const char* scopes[] = { "withdrawals", "transfers", "debits" };
+        for (const VelocityRule& rule : bank.velocityRules()) {
+            out << scopes[rule.scope] << " window " << rule.windowSeconds << "s max-count " << rule.maxCount << " max-amount " << rule.maxAmount << '\n';
+        }
+    });
+    commands.add("balance-as-of", "<account> <time>", 2, [&bank](const vector<string>& args, ostream& out) {
+        out << bank.balanceAsOf(CommandProcessor::toInt(args[0]), parseAsOfTime(args[1])) << '\n';
+    });
+    commands.add("balances-as-of", "<time>", 1, [&bank](const vector<string>& args, ostream& out) {
+        for (const auto& entry : bank.balancesAsOf(parseAsOfTime(args[0]))) out << entry.first << ' ' << entry.second << '\n';
+    });
+    commands.add("stats", "", 0, [](const vector<string>&, ostream& out) { OperationStats::dump(out); });
+}
+
+// Non-interactive mode: answers commands from a script file, or from stdin when no file is given
+int runScript(Bank& bank, const char* path) {
+    CommandProcessor commands;
+    registerCommands(commands, bank);
+    bank.setGroupCommit(true);
+    commands.setFlushHook([&bank]() { bank.flush(); });
+
+    ios::sync_with_stdio(false);  // Lets the processor see how much piped input is already buffered
+    if (!path) {
+        commands.run(cin, cout);
+        return 0;
+    }
+    ifstream script(path);
+    if (!script) {
+        cerr << "Unable to open script " << path << endl;
+        return 1;
+    }
+    commands.run(script, cout);
+    return 0;
+}
+
+// Service mode: answers clients on a Unix domain socket until SIGINT or SIGTERM
+int runServer(Bank& bank, const char* socketPath, size_t workers) {
+    CommandProcessor commands;
+    registerCommands(commands, bank);
+    bank.setGroupCommit(true);
+    commands.setFlushHook([&bank]() { bank.flush(); });
+
+    try {
+        CommandServer server(commands, socketPath, workers, true);  // Bank is not thread-safe
+        cout << "Serving on " << socketPath << " with " << workers << " workers" << endl;
+        server.run();
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
     }
+    return 0;
 }
 
 // Simple user interface
@@ -263,6 +1429,7 @@ void userInterface(Bank& bank) {
         cout << "5. Display All Accounts\n";
         cout << "6. Display All Transactions\n";
         cout << "7. Exit\n";
+        cout << "8. Run End of Day\n";
         cout << "Enter your choice: ";
         cin >> choice;
 
@@ -282,7 +1449,14 @@ void userInterface(Bank& bank) {
                     case 2: account = new CurrentAccount(num, bal); break;
                     default: cout << "Invalid type." << endl; break;
                 }
-                if (account) bank.createAccount(account);
+                if (account) {
+                    try {
+                        bank.createAccount(account);
+                    } catch (const runtime_error& e) {
+                        delete account;
+                        cout << "Error: " << e.what() << endl;
+                    }
+                }
                 break;
             }
             case 2: {
@@ -337,6 +1511,16 @@ void userInterface(Bank& bank) {
                 break;
             case 7:
                 return;
+            case 8: {
+                try {
+                    EndOfDayReport report = bank.runEndOfDay();
+                    cout << "Posted interest of $" << report.interestPaid << " to " << report.interestPostings << " accounts and fees of $"
+                         << report.feesCharged << " to " << report.feePostings << " accounts." << endl;
+                } catch (const runtime_error& e) {
+                    cout << "Error: " << e.what() << endl;
+                }
+                break;
+            }
             default:
                 cout << "Invalid choice." << endl;
                 break;
@@ -344,11 +1528,34 @@ void userInterface(Bank& bank) {
     }
 }
 
-int main() {
-    Bank bank;
+int main(int argc, char* argv[]) {
+    OperationStats::dumpAtExitIfRequested();  // OPERATION_STATS=<file> dumps timings at exit
 
-    // Simple user interface to interact with the banking system
-    userInterface(bank);
+    // "--serve <socket> [workers]" defaults to one worker per core
+    size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), CommandServer::kMaxWorkers);
+    if (argc > 3 && string(argv[1]) == "--serve" && !CommandServer::parseWorkerCount(argv[3], workers)) {
+        cerr << "Usage: " << argv[0] << " --serve <socket> [workers]   (workers: 1 to " << CommandServer::kMaxWorkers << ")" << endl;
+        return 1;
+    }
 
-    return 0;
+    // Opening a store fails if another process has it open
+    try {
+        Bank bank;
+
+        // "--script [file]" runs commands from the file (or stdin) instead of the menu
+        if (argc > 1 && string(argv[1]) == "--script") return runScript(bank, argc > 2 ? argv[2] : nullptr);
+
+        // "--serve <socket> [workers]" answers the same commands over a Unix domain socket
+        if (argc > 2 && string(argv[1]) == "--serve") {
+            return runServer(bank, argv[2], workers);
+        }
+
+        // Simple user interface to interact with the banking system
+        userInterface(bank);
+
+        return 0;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
 }
@@ -0,0 +1,234 @@
+// Sequence-numbered change events, for consumers that follow a program's changes instead of
+// polling and re-parsing its state. Used by the Hotel program, one stream per property.
+//
+// ChangeStream is a bounded ring of the most recent events. It has a single producer (the
+// owner publishes while holding its own lock) and any number of consumers on any threads,
+// which never block the producer or each other: each slot is a seqlock whose version says
+// which event it holds, so a consumer that falls a full ring behind sees that its event was
+// overwritten instead of reading a torn one. Consumers keep their own position and ask for
+// "events from sequence N"; sequence numbers start at 1 and never repeat.
+//
+// ChangeLog is the optional on-disk copy: one "<sequence> <event>" line per event, appended
+// in order, so it can be followed with tail -f or read from any offset. Consumers that fell
+// off the ring resume from it; events from a time the log was turned off are missing from it.
+// Appends are synced before the owner syncs the change itself, and on open every line at or
+// after the owner's persisted next sequence is cut off, so the log holds only durable changes.
+
+#ifndef CHANGE_STREAM_H
+#define CHANGE_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct ChangeEvent {
+    uint64_t sequence;
+    std::string text;
+};
+
+class ChangeStream {
+public:
+    static constexpr size_t kMaxEventSize = 240;
+
+    explicit ChangeStream(size_t capacity) : slots(capacity) {}
+
+    ChangeStream(const ChangeStream&) = delete;
+    ChangeStream& operator=(const ChangeStream&) = delete;
+
+    // Sets the sequence number of the next event; called once, before anything is published.
+    void resumeAt(uint64_t sequence) { next.store(sequence, std::memory_order_release); }
+
+    uint64_t nextSequence() const { return next.load(std::memory_order_acquire); }
+
+    // Producer only. Events longer than kMaxEventSize are the caller's bug and are refused.
+    void publish(const ChangeEvent& event) {
+        if (event.text.size() > kMaxEventSize) throw std::runtime_error("Change event too long");
+        Slot& slot = slots[event.sequence % slots.size()];
+        uint64_t words[kWords] = {};
+        std::memcpy(words, event.text.data(), event.text.size());
+        slot.version.store(event.sequence * 2 + 1, std::memory_order_relaxed);  // Odd: being written
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.length.store(static_cast<uint32_t>(event.text.size()), std::memory_order_relaxed);
+        for (size_t i = 0; i < kWords; ++i) slot.words[i].store(words[i], std::memory_order_relaxed);
+        slot.version.store(event.sequence * 2 + 2, std::memory_order_release);
+        next.store(event.sequence + 1, std::memory_order_release);
+    }
+
+    // Appends up to `max` events from sequence `from` onwards to `out`. Returns false if
+    // `from` has already left the ring (nothing is appended then); asking past the end
+    // returns true with nothing appended.
+    bool read(uint64_t from, size_t max, std::vector<ChangeEvent>& out) const {
+        uint64_t end = std::min(nextSequence(), from + max);
+        std::vector<ChangeEvent> found;
+        for (uint64_t sequence = from; sequence < end; ++sequence) {
+            const Slot& slot = slots[sequence % slots.size()];
+            uint64_t version = slot.version.load(std::memory_order_acquire);
+            if (version != sequence * 2 + 2) return false;
+            uint64_t words[kWords];
+            uint32_t length = slot.length.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < kWords; ++i) words[i] = slot.words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) != version) return false;  // Overwritten while copying
+            found.push_back(ChangeEvent{ sequence, std::string(reinterpret_cast<const char*>(words), std::min<size_t>(length, kMaxEventSize)) });
+        }
+        out.insert(out.end(), found.begin(), found.end());
+        return true;
+    }
+
+private:
+    static constexpr size_t kWords = kMaxEventSize / 8;
+
+    struct Slot {
+        std::atomic<uint64_t> version{0};  // 2 * sequence + 2 once the event is complete
+        std::atomic<uint32_t> length{0};
+        std::atomic<uint64_t> words[kWords] = {};
+    };
+
+    std::vector<Slot> slots;
+    std::atomic<uint64_t> next{1};
+};
+
+class ChangeLog {
+public:
+    // Opens (or creates) the log and drops any line whose sequence is `nextSequence` or later,
+    // along with a torn final line.
+    ChangeLog(const std::string& path, uint64_t nextSequence) : path(path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) throw std::runtime_error("Unable to open change log " + path);
+        off_t fileSize = ::lseek(fd, 0, SEEK_END);
+        off_t offset = 0;
+        std::string chunk;
+        std::string line;
+        bool keep = true;
+        while (keep && offset < fileSize) {
+            chunk.resize(static_cast<size_t>(std::min<off_t>(kReadChunk, fileSize - offset)));
+            if (::pread(fd, &chunk[0], chunk.size(), offset) != static_cast<ssize_t>(chunk.size())) break;
+            offset += static_cast<off_t>(chunk.size());
+            size_t start = 0;
+            size_t newline;
+            while (keep && (newline = chunk.find('\n', start)) != std::string::npos) {
+                line.append(chunk, start, newline - start);
+                uint64_t sequence = std::strtoull(line.c_str(), nullptr, 10);
+                keep = sequence != 0 && sequence >= next && sequence < nextSequence;
+                if (keep) {
+                    noteLine(sequence, size);
+                    size += static_cast<off_t>(line.size() + 1);
+                }
+                line.clear();
+                start = newline + 1;
+            }
+            if (keep) line.append(chunk, start, std::string::npos);
+        }
+        if (size < fileSize && ::ftruncate(fd, size) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Unable to truncate change log " + path);
+        }
+        next = nextSequence;  // Anything between the last line and here happened with the log off
+    }
+
+    ~ChangeLog() { ::close(fd); }
+
+    ChangeLog(const ChangeLog&) = delete;
+    ChangeLog& operator=(const ChangeLog&) = delete;
+
+    // Producer only: writes the events in order and syncs them.
+    void append(const std::vector<ChangeEvent>& events) {
+        if (events.empty()) return;
+        std::string lines;
+        for (const ChangeEvent& event : events) lines += std::to_string(event.sequence) + ' ' + event.text + '\n';
+        size_t written = 0;
+        while (written < lines.size()) {
+            ssize_t n = ::write(fd, lines.data() + written, lines.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) fail("write");
+            written += static_cast<size_t>(n);
+        }
+        if (::fdatasync(fd) != 0) fail("sync");
+
+        std::lock_guard<std::mutex> lock(mutex);
+        off_t offset = size;
+        for (const ChangeEvent& event : events) {
+            noteLine(event.sequence, offset);
+            offset += static_cast<off_t>(std::to_string(event.sequence).size() + 1 + event.text.size() + 1);
+        }
+        size = offset;
+    }
+
+    // Appends up to `max` logged events from sequence `from` onwards to `out`, stopping at any
+    // gap left by a time the log was off. Returns false if event `from` isn't in the log.
+    bool read(uint64_t from, size_t max, std::vector<ChangeEvent>& out) const {
+        off_t offset;
+        off_t end;
+        uint64_t logged;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (marks.empty() || from < marks.front().first) return false;
+            auto mark = std::upper_bound(marks.begin(), marks.end(), std::make_pair(from, std::numeric_limits<off_t>::max())) - 1;
+            offset = mark->second;
+            end = size;
+            logged = next;
+        }
+        std::string chunk;
+        std::string line;
+        size_t found = 0;
+        uint64_t expected = from;  // Stop at a gap rather than skip it
+        while (offset < end && found < max) {
+            chunk.resize(static_cast<size_t>(std::min<off_t>(kReadChunk, end - offset)));
+            if (::pread(fd, &chunk[0], chunk.size(), offset) != static_cast<ssize_t>(chunk.size())) {
+                throw std::runtime_error("Unable to read change log " + path);
+            }
+            offset += static_cast<off_t>(chunk.size());
+            size_t start = 0;
+            size_t newline;
+            while ((newline = chunk.find('\n', start)) != std::string::npos && found < max) {
+                line.append(chunk, start, newline - start);
+                size_t space = line.find(' ');
+                uint64_t sequence = std::strtoull(line.c_str(), nullptr, 10);
+                if (sequence > expected) return found > 0;
+                if (sequence == expected) {
+                    out.push_back(ChangeEvent{ sequence, space == std::string::npos ? std::string() : line.substr(space + 1) });
+                    ++found;
+                    ++expected;
+                }
+                line.clear();
+                start = newline + 1;
+            }
+            line.append(chunk, start, std::string::npos);
+        }
+        return found > 0 || from >= logged;
+    }
+
+private:
+    static constexpr off_t kReadChunk = 256 << 10;
+    static constexpr uint64_t kMarkInterval = 1024;
+
+    std::string path;
+    int fd = -1;
+    mutable std::mutex mutex;  // Guards size, marks and next for readers; the data itself is append-only
+    off_t size = 0;
+    uint64_t next = 0;
+    std::vector<std::pair<uint64_t, off_t>> marks;  // Offset of the first line and every kMarkInterval-th after it
+
+    // Cuts off whatever part of a failed append reached the file, so the next one lines up
+    [[noreturn]] void fail(const char* what) {
+        if (::ftruncate(fd, size) != 0) {}
+        throw std::runtime_error(std::string("Unable to ") + what + " change log " + path);
+    }
+
+    void noteLine(uint64_t sequence, off_t offset) {
+        if (marks.empty() || sequence - marks.back().first >= kMarkInterval) marks.emplace_back(sequence, offset);
+        next = sequence + 1;
+    }
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "CommandProtocol.h"
+
+using namespace std;
+
+// Client for the --serve mode of the Bank, Hotel and Library programs.
+//
+//   CommandClient <socket>
+//       Sends each line from stdin as a request and prints the responses.
+//   CommandClient <socket> --bench <connections> <requests-per-connection> <pipeline-depth> <command>
+//       Load generator: every connection keeps up to <pipeline-depth> copies of <command> in flight.
+//       "{n}" in the command is replaced with the request number, e.g. "deposit 1 {n}".
+
+int connectTo(const string& socketPath) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || socketPath.size() >= sizeof(address.sun_path)) throw runtime_error("Unable to create socket");
+    socketPath.copy(address.sun_path, socketPath.size());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        throw runtime_error("Unable to connect to " + socketPath + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+void sendAll(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw runtime_error("Connection closed by server");
+        sent += n;
+    }
+}
+
+// Pipes stdin to the server on one thread while the responses are copied to stdout on this one
+int runClient(const string& socketPath) {
+    int fd = connectTo(socketPath);
+    thread writer([fd]() {
+        string line;
+        string batch;
+        try {
+            while (getline(cin, line)) {
+                batch += line;
+                batch += '\n';
+                if (batch.size() >= (64 << 10) || cin.rdbuf()->in_avail() <= 0) {
+                    sendAll(fd, batch);
+                    batch.clear();
+                }
+            }
+            sendAll(fd, batch);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    char buffer[64 << 10];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0) cout.write(buffer, got);
+    cout.flush();
+    writer.join();
+    close(fd);
+    return 0;
+}
+
+struct BenchResult {
+    size_t completed = 0;
+    size_t errors = 0;
+    vector<double> latenciesUs;
+};
+
+string expand(const string& command, size_t n) {
+    string line = command;
+    size_t pos = line.find("{n}");
+    if (pos != string::npos) line.replace(pos, 3, to_string(n));
+    return line + '\n';
+}
+
+void benchConnection(const string& socketPath, const string& command, size_t requests, size_t depth, size_t firstNumber, BenchResult& result) {
+    typedef chrono::steady_clock Clock;
+    int fd = connectTo(socketPath);
+    deque<Clock::time_point> inFlight;
+    size_t sent = 0;
+    string input;
+    char buffer[64 << 10];
+    result.latenciesUs.reserve(requests);
+
+    while (result.completed < requests) {
+        string batch;
+        Clock::time_point now = Clock::now();
+        while (sent < requests && inFlight.size() < depth) {
+            batch += expand(command, firstNumber + sent++);
+            inFlight.push_back(now);
+        }
+        if (!batch.empty()) sendAll(fd, batch);
+
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) throw runtime_error("Connection closed by server");
+        input.append(buffer, got);
+
+        // Every response ends with one status line; data lines start with "- "
+        size_t start = 0;
+        size_t end;
+        Clock::time_point received = Clock::now();
+        while ((end = input.find('\n', start)) != string::npos) {
+            if (input.compare(start, 2, "- ") != 0) {
+                if (input.compare(start, 3, "ERR") == 0) ++result.errors;
+                result.latenciesUs.push_back(chrono::duration<double, micro>(received - inFlight.front()).count());
+                inFlight.pop_front();
+                ++result.completed;
+            }
+            start = end + 1;
+        }
+        input.erase(0, start);
+    }
+    close(fd);
+}
+
+// The bench counts one response per line it sends, so the command must be exactly one request:
+// a blank or comment line would get no response and the connection would wait forever.
+int runBench(const string& socketPath, size_t connections, size_t requests, size_t depth, const string& command) {
+    if (!CommandProcessor::carriesRequest(command) || command.find_first_of("\r\n") != string::npos) {
+        throw runtime_error("The bench command must be a single request line");
+    }
+    vector<BenchResult> results(connections);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        threads.emplace_back([&, i]() {
+            try {
+                benchConnection(socketPath, command, requests, depth, i * requests, results[i]);
+            } catch (const exception& e) {
+                cerr << "Connection " << i << ": " << e.what() << endl;
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t completed = 0;
+    size_t errors = 0;
+    vector<double> latencies;
+    for (const BenchResult& result : results) {
+        completed += result.completed;
+        errors += result.errors;
+        latencies.insert(latencies.end(), result.latenciesUs.begin(), result.latenciesUs.end());
+    }
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0 : latencies[min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+
+    cout << "requests " << completed << " errors " << errors << " seconds " << seconds
+         << " requests/s " << (seconds > 0 ? completed / seconds : 0) << endl;
+    cout << "latency-us p50 " << percentile(0.50) << " p99 " << percentile(0.99)
+         << " p99.9 " << percentile(0.999) << " max " << (latencies.empty() ? 0.0 : latencies.back()) << endl;
+    return completed == connections * requests ? 0 : 1;
+}
+
+// A whole, positive count; stoul would also take "-1" and wrap it around
+bool parseCount(const string& text, size_t& count) {
+    auto result = from_chars(text.data(), text.data() + text.size(), count);
+    return result.ec == errc() && result.ptr == text.data() + text.size() && count > 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc == 2) return runClient(argv[1]);
+        size_t connections, requests, depth;
+        if (argc == 7 && string(argv[2]) == "--bench" && parseCount(argv[3], connections) && parseCount(argv[4], requests) &&
+            parseCount(argv[5], depth)) {
+            return runBench(argv[1], connections, requests, depth, argv[6]);
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    cerr << "Usage: " << argv[0] << " <socket>" << endl;
+    cerr << "       " << argv[0] << " <socket> --bench <connections> <requests-per-connection> <pipeline-depth> <command>" << endl;
+    return 1;
+}
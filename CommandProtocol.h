@@ -0,0 +1,208 @@
+// Line-oriented command protocol shared by the Bank, Hotel and Library programs.
+//
+// Each request is one line: a command name followed by whitespace-separated arguments.
+// Arguments containing spaces are written in double quotes ("The Great Gatsby"); a backslash
+// escapes the next character inside quotes. Blank lines and lines starting with '#' are ignored,
+// so scripts can carry comments.
+//
+// Each response is zero or more data lines, each prefixed with "- ", followed by exactly one
+// status line: "OK" or "ERR <message>". Responses come back in request order, so a client can
+// send many requests before reading any responses (pipelining).
+
+#ifndef COMMAND_PROTOCOL_H
+#define COMMAND_PROTOCOL_H
+
+#include <cctype>
+#include <functional>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class CommandProcessor {
+public:
+    // A handler receives the arguments after the command name and writes any data lines to `out`.
+    // It reports failure by throwing; the exception message becomes the ERR line.
+    typedef std::function<void(const std::vector<std::string>& args, std::ostream& out)> Handler;
+
+    // `minArgs`..`maxArgs` is the accepted argument count; anything else answers with the usage text.
+    void add(const std::string& name, const std::string& usage, size_t minArgs, size_t maxArgs, Handler handler) {
+        commands[name] = Command{ usage, minArgs, maxArgs, std::move(handler) };
+    }
+
+    void add(const std::string& name, const std::string& usage, size_t args, Handler handler) {
+        add(name, usage, args, args, std::move(handler));
+    }
+
+    // Called before buffered responses are written out. Programs use it to make the changes
+    // behind those responses durable first (group commit).
+    void setFlushHook(std::function<void()> hook) { flushHook = std::move(hook); }
+
+    // Executes one request line and appends its complete response to `response`.
+    // Returns false for lines that carry no request (blank or comment) and get no response.
+    bool execute(const std::string& line, std::string& response) const {
+        if (!carriesRequest(line)) return false;
+        std::vector<std::string> tokens;
+        try {
+            tokens = tokenize(line);
+        } catch (const std::exception& e) {
+            response += "ERR ";
+            response += e.what();
+            response += '\n';
+            return true;
+        }
+        if (tokens.empty()) return false;
+
+        std::ostringstream data;
+        try {
+            std::string name = tokens[0];
+            tokens.erase(tokens.begin());
+            if (name == "help") {
+                for (const auto& entry : commands) {
+                    data << entry.first << (entry.second.usage.empty() ? "" : " ") << entry.second.usage << '\n';
+                }
+            } else {
+                auto it = commands.find(name);
+                if (it == commands.end()) throw std::runtime_error("Unknown command: " + name);
+                const Command& command = it->second;
+                if (tokens.size() < command.minArgs || tokens.size() > command.maxArgs) {
+                    throw std::runtime_error("Usage: " + name + " " + command.usage);
+                }
+                command.handler(tokens, data);
+            }
+        } catch (const std::exception& e) {
+            appendData(data.str(), response);
+            response += "ERR ";
+            response += e.what();
+            response += '\n';
+            return true;
+        }
+        appendData(data.str(), response);
+        response += "OK\n";
+        return true;
+    }
+
+    // Answers requests from `in` until end of input. Responses are buffered and only written
+    // (after the flush hook runs) once no further request is already waiting in the input
+    // buffer, so a pipelined burst costs one durable commit and one write, not one per request.
+    // Returns the number of requests executed.
+    size_t run(std::istream& in, std::ostream& out) const {
+        std::string line;
+        std::string response;
+        size_t executed = 0;
+        while (std::getline(in, line)) {
+            if (execute(line, response)) ++executed;
+            if (response.size() >= kMaxBuffered || in.rdbuf()->in_avail() <= 0) flush(response, out);
+        }
+        flush(response, out);
+        return executed;
+    }
+
+    void flush(std::string& response, std::ostream& out) const {
+        if (response.empty()) return;
+        commitPending();
+        out.write(response.data(), response.size());
+        out.flush();
+        response.clear();
+    }
+
+    // Runs the flush hook; for callers that write responses out themselves.
+    void commitPending() const {
+        if (flushHook) flushHook();
+    }
+
+    // False for blank lines and comments, which execute() ignores. Decided on the raw line, so
+    // a comment is ignored whatever it contains.
+    static bool carriesRequest(const std::string& line) {
+        size_t pos = 0;
+        while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) ++pos;
+        return pos < line.size() && line[pos] != '#';
+    }
+
+    static std::vector<std::string> tokenize(const std::string& line) {
+        std::vector<std::string> tokens;
+        size_t pos = 0;
+        size_t end = line.size();
+        if (end && line[end - 1] == '\r') --end;
+        while (true) {
+            while (pos < end && isspace(static_cast<unsigned char>(line[pos]))) ++pos;
+            if (pos >= end) break;
+            std::string token;
+            if (line[pos] == '"') {
+                ++pos;
+                while (pos < end && line[pos] != '"') {
+                    if (line[pos] == '\\' && pos + 1 < end) ++pos;
+                    token += line[pos++];
+                }
+                if (pos >= end) throw std::runtime_error("Unterminated quote");
+                ++pos;
+            } else {
+                while (pos < end && !isspace(static_cast<unsigned char>(line[pos]))) token += line[pos++];
+            }
+            tokens.push_back(token);
+        }
+        return tokens;
+    }
+
+    // Quotes `text` so that tokenize() reads it back as a single argument.
+    static std::string quote(const std::string& text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        return quoted + '"';
+    }
+
+    static int toInt(const std::string& text) {
+        size_t parsed = 0;
+        int value = 0;
+        try {
+            value = std::stoi(text, &parsed);
+        } catch (const std::exception&) {
+        }
+        if (parsed == 0 || parsed != text.size()) throw std::runtime_error("Invalid number: " + text);
+        return value;
+    }
+
+    static double toDouble(const std::string& text) {
+        size_t parsed = 0;
+        double value = 0;
+        try {
+            value = std::stod(text, &parsed);
+        } catch (const std::exception&) {
+        }
+        if (parsed == 0 || parsed != text.size()) throw std::runtime_error("Invalid amount: " + text);
+        return value;
+    }
+
+private:
+    struct Command {
+        std::string usage;
+        size_t minArgs;
+        size_t maxArgs;
+        Handler handler;
+    };
+
+    static constexpr size_t kMaxBuffered = 64 << 10;
+
+    std::map<std::string, Command> commands;
+    std::function<void()> flushHook;
+
+    static void appendData(const std::string& data, std::string& response) {
+        size_t start = 0;
+        while (start < data.size()) {
+            size_t end = data.find('\n', start);
+            if (end == std::string::npos) end = data.size();
+            response += "- ";
+            response.append(data, start, end - start);
+            response += '\n';
+            start = end + 1;
+        }
+    }
+};
+
+#endif
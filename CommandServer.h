@@ -0,0 +1,333 @@
+// Long-lived service mode for the Bank, Hotel and Library programs.
+//
+// CommandServer listens on a Unix domain socket and speaks the line protocol from
+// CommandProtocol.h. One thread runs an epoll event loop that accepts connections and moves
+// bytes; a pool of worker threads executes the requests. Clients may pipeline: every complete
+// line that has arrived on a connection is handed to a worker as one batch, answered in order,
+// and made durable with a single flush-hook call before any of its responses are sent.
+// A connection has at most one batch in flight, which keeps its responses in request order.
+// A last line without a trailing newline is answered too, once the peer closes its end.
+// If the flush hook fails, the server stops: the batch's changes are applied but may not be
+// durable, so it can answer neither OK nor ERR.
+//
+// A connection is only read from while its unread input and unsent output are below their
+// caps, and not at all once the peer has closed its end; a client that pipelines faster than
+// it reads its answers is paused, not buffered without bound.
+//
+// Programs whose operations are not thread-safe pass serializeCommands = true; their requests
+// then run one at a time while parsing, formatting and socket I/O still overlap.
+
+#ifndef COMMAND_SERVER_H
+#define COMMAND_SERVER_H
+
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "CommandProtocol.h"
+
+class CommandServer {
+public:
+    static constexpr size_t kMaxWorkers = 256;
+
+    // Parses the worker count given on the command line; false unless it is a whole number
+    // from 1 to kMaxWorkers.
+    static bool parseWorkerCount(const std::string& text, size_t& workers) {
+        size_t value = 0;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size() || value == 0 || value > kMaxWorkers) return false;
+        workers = value;
+        return true;
+    }
+
+    CommandServer(const CommandProcessor& processor, const std::string& socketPath, size_t workerCount, bool serializeCommands)
+        : processor(processor), socketPath(socketPath), serialize(serializeCommands) {
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (listenFd < 0 || socketPath.size() >= sizeof(address.sun_path)) throw std::runtime_error("Unable to create socket " + socketPath);
+        socketPath.copy(address.sun_path, socketPath.size());
+        ::unlink(socketPath.c_str());
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+            ::close(listenFd);
+            throw std::runtime_error("Unable to listen on " + socketPath);
+        }
+
+        epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        watch(listenFd, EPOLLIN);
+        watch(wakeFd, EPOLLIN);
+
+        activeWakeFd = wakeFd;
+        std::signal(SIGINT, onStopSignal);
+        std::signal(SIGTERM, onStopSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        for (size_t i = 0; i < (workerCount ? workerCount : 1); ++i) workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~CommandServer() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto& worker : workers) worker.join();
+        for (auto& entry : connections) ::close(entry.first);
+        activeWakeFd = -1;
+        ::close(wakeFd);
+        ::close(epollFd);
+        ::close(listenFd);
+        ::unlink(socketPath.c_str());
+    }
+
+    CommandServer(const CommandServer&) = delete;
+    CommandServer& operator=(const CommandServer&) = delete;
+
+    // Serves until SIGINT or SIGTERM.
+    void run() {
+        epoll_event events[64];
+        while (!stopRequested) {
+            int ready = ::epoll_wait(epollFd, events, 64, -1);
+            if (ready < 0 && errno != EINTR) throw std::runtime_error("epoll_wait failed");
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptConnections();
+                } else if (fd == wakeFd) {
+                    uint64_t count;
+                    while (::read(wakeFd, &count, sizeof(count)) > 0) {}
+                    collectResults();
+                } else {
+                    auto it = connections.find(fd);
+                    if (it == connections.end()) continue;
+                    Connection& connection = *it->second;
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readInput(connection);
+                    if (events[i].events & EPOLLERR) connection.peerClosed = true;  // Nothing more can be exchanged
+                    if (events[i].events & EPOLLOUT) writeOutput(connection);
+                    service(connection);
+                }
+            }
+        }
+    }
+
+private:
+    struct Connection {
+        int fd;
+        std::string input;
+        std::string output;
+        bool busy = false;       // A batch from this connection is with a worker
+        bool peerClosed = false;
+        uint32_t watched = EPOLLIN;  // Events registered with epoll; 0 when not registered
+    };
+
+    struct Job {
+        Connection* connection;
+        std::string batch;       // Complete request lines
+        std::string response;
+    };
+
+    static constexpr size_t kMaxLine = 1 << 20;       // A longer line without '\n' drops the connection
+    static constexpr size_t kMaxPendingOutput = 4 << 20;  // Stop dispatching and reading until the client reads
+    static constexpr size_t kMaxPendingInput = 4 << 20;   // Stop reading until a worker takes the queued requests
+
+    const CommandProcessor& processor;
+    std::string socketPath;
+    bool serialize;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::map<int, std::unique_ptr<Connection>> connections;
+
+    std::vector<std::thread> workers;
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    std::deque<Job> pending;
+    std::deque<Job> finished;
+    bool stopping = false;
+    std::mutex executionMutex;  // Held per batch when serialize is set
+
+    inline static std::atomic<bool> stopRequested{false};
+    inline static std::atomic<int> activeWakeFd{-1};
+
+    static void onStopSignal(int) {
+        stopRequested = true;
+        int fd = activeWakeFd;
+        uint64_t one = 1;
+        if (fd >= 0 && ::write(fd, &one, sizeof(one)) < 0) {}
+    }
+
+    void watch(int fd, uint32_t events) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    // Waits for input only while the connection can take more, and for output only while some
+    // is queued. Hangups are reported even with no events requested, so a connection with
+    // nothing to wait for (its batch is with a worker) is taken out of the epoll set.
+    void updateWatch(Connection& connection) {
+        uint32_t events = 0;
+        if (!connection.peerClosed && connection.input.size() < kMaxPendingInput && connection.output.size() < kMaxPendingOutput) {
+            events |= EPOLLIN;
+        }
+        if (!connection.output.empty()) events |= EPOLLOUT;
+        if (events == connection.watched) return;
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = connection.fd;
+        int op = connection.watched == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        ::epoll_ctl(epollFd, op, connection.fd, &event);
+        connection.watched = events;
+    }
+
+    void acceptConnections() {
+        while (true) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            std::unique_ptr<Connection> connection(new Connection());
+            connection->fd = fd;
+            connections[fd] = std::move(connection);
+            watch(fd, EPOLLIN);
+        }
+    }
+
+    void readInput(Connection& connection) {
+        char buffer[64 << 10];
+        while (!connection.peerClosed && connection.input.size() < kMaxPendingInput) {
+            ssize_t got = ::read(connection.fd, buffer, sizeof(buffer));
+            if (got > 0) {
+                connection.input.append(buffer, got);
+                continue;
+            }
+            if (got == 0 && !connection.input.empty() && connection.input.back() != '\n' && connection.input.size() <= kMaxLine) {
+                connection.input += '\n';  // The peer is done, so an unterminated last line is still a request
+            }
+            if (got == 0 || (errno != EAGAIN && errno != EINTR)) connection.peerClosed = true;
+            if (got < 0 && errno == EINTR) continue;
+            return;
+        }
+    }
+
+    void writeOutput(Connection& connection) {
+        size_t written = 0;
+        while (written < connection.output.size()) {
+            ssize_t sent = ::send(connection.fd, connection.output.data() + written, connection.output.size() - written, MSG_NOSIGNAL);
+            if (sent > 0) {
+                written += sent;
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (sent < 0 && errno != EAGAIN) {
+                    connection.peerClosed = true;
+                    connection.output.clear();
+                    written = 0;
+                }
+                break;
+            }
+        }
+        connection.output.erase(0, written);
+    }
+
+    // Hands the next batch to a worker, or closes the connection once it has nothing left to do.
+    void service(Connection& connection) {
+        if (!connection.busy && connection.output.size() < kMaxPendingOutput) {
+            size_t lastNewline = connection.input.rfind('\n');
+            if (lastNewline != std::string::npos) {
+                Job job{ &connection, connection.input.substr(0, lastNewline + 1), std::string() };
+                connection.input.erase(0, lastNewline + 1);
+                connection.busy = true;
+                {
+                    std::lock_guard<std::mutex> lock(jobMutex);
+                    pending.push_back(std::move(job));
+                }
+                jobReady.notify_one();
+            } else if (connection.input.size() > kMaxLine) {
+                connection.peerClosed = true;
+                connection.input.clear();
+            }
+        }
+        if (connection.peerClosed && !connection.busy && connection.output.empty()) {
+            int fd = connection.fd;
+            if (connection.watched) ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            ::close(fd);
+            connections.erase(fd);
+            return;
+        }
+        updateWatch(connection);
+    }
+
+    void collectResults() {
+        std::deque<Job> done;
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            done.swap(finished);
+        }
+        for (Job& job : done) {
+            Connection& connection = *job.connection;
+            connection.busy = false;
+            connection.output += job.response;
+            writeOutput(connection);
+            service(connection);
+        }
+    }
+
+    void workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobReady.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (stopping) return;
+                job = std::move(pending.front());
+                pending.pop_front();
+            }
+
+            std::unique_lock<std::mutex> execution(executionMutex, std::defer_lock);
+            if (serialize) execution.lock();
+            size_t start = 0;
+            while (start < job.batch.size()) {
+                size_t end = job.batch.find('\n', start);
+                processor.execute(job.batch.substr(start, end - start), job.response);
+                start = end + 1;
+            }
+            try {
+                processor.commitPending();
+            } catch (const std::exception& e) {
+                // The batch's changes are already applied, so reporting ERR would be as wrong as OK
+                std::cerr << "Unable to make changes durable, stopping: " << e.what() << std::endl;
+                std::abort();
+            }
+            if (execution.owns_lock()) execution.unlock();
+
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                finished.push_back(std::move(job));
+            }
+            uint64_t one = 1;
+            if (::write(wakeFd, &one, sizeof(one)) < 0) {}
+        }
+    }
+};
+
+#endif
@@ -4,6 +4,25 @@
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <set>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <algorithm>
+#include <ctime>
+#include <cstdlib>
+#include <cctype>
+#include <functional>
+
+#include <thread>
+#include "ChangeStream.h"
+#include "CommandProtocol.h"
+#include "CommandServer.h"
+#include "OperationStats.h"
+#include "RecordStore.h"
 
 using namespace std;
 
@@ -23,8 +42,8 @@ public:
 
     virtual string getRoomType() const = 0; // Pure virtual function for room type
 
-    void display() const {
-        cout << getRoomType() << " Room Number: " << roomNumber << ", Available: " << (isAvailable ? "Yes" : "No") << endl;
+    void display(ostream& out = cout) const {
+        out << getRoomType() << " Room Number: " << roomNumber << ", Available: " << (isAvailable ? "Yes" : "No") << endl;
     }
 };
 
@@ -75,159 +94,739 @@ public:
     Customer* getCustomer() const { return customer; }
 };
 
-// Hotel class with file I/O
+// Creates a room from its stored type name
+Room* makeRoom(const string& roomType, int roomNumber) {
+    if (roomType == "Single") return new SingleRoom(roomNumber);
+    if (roomType == "Double") return new DoubleRoom(roomNumber);
+    if (roomType == "Suite") return new SuiteRoom(roomNumber);
+    return nullptr;
+}
+
+// Room numbers follow the floor-by-slot scheme (101-104, 201-202, ...), so a room's number is
+// its position in a table with a row of kSlotsPerFloor entries per floor: finding a room, or
+// the rooms on a floor, is an array access with no hashing. The table only grows to the
+// highest floor in use, up to kMaxFloors; numbers outside it are kept in an ordered map.
+class RoomDirectory {
+public:
+    static constexpr int kSlotsPerFloor = 100;
+    static constexpr int kMaxFloors = 100;
+
+    Room* find(int roomNumber) const {
+        if (!isDense(roomNumber)) {
+            auto it = irregular.find(roomNumber);
+            return it == irregular.end() ? nullptr : it->second;
+        }
+        return static_cast<size_t>(roomNumber) < dense.size() ? dense[roomNumber] : nullptr;
+    }
+
+    // The caller has checked that the number is free
+    void add(Room* room) {
+        int roomNumber = room->getRoomNumber();
+        if (!isDense(roomNumber)) {
+            irregular.emplace(roomNumber, room);
+            return;
+        }
+        if (static_cast<size_t>(roomNumber) >= dense.size()) dense.resize((roomNumber / kSlotsPerFloor + 1) * kSlotsPerFloor, nullptr);
+        dense[roomNumber] = room;
+    }
+
+    // Rooms numbered floor * kSlotsPerFloor up to the next floor, in number order
+    vector<Room*> onFloor(int floor) const {
+        vector<Room*> found;
+        if (floor < 0 || floor > numeric_limits<int>::max() / kSlotsPerFloor - 1) return found;
+        int first = floor * kSlotsPerFloor;
+        if (floor < kMaxFloors) {
+            for (size_t slot = first; slot < min<size_t>(first + kSlotsPerFloor, dense.size()); ++slot) {
+                if (dense[slot]) found.push_back(dense[slot]);
+            }
+            return found;
+        }
+        for (auto it = irregular.lower_bound(first); it != irregular.end() && it->first < first + kSlotsPerFloor; ++it) found.push_back(it->second);
+        return found;
+    }
+
+private:
+    vector<Room*> dense;         // By room number, a whole floor at a time
+    map<int, Room*> irregular;  // Negative numbers, and floors from kMaxFloors up
+
+    static bool isDense(int roomNumber) { return roomNumber >= 0 && roomNumber < kMaxFloors * kSlotsPerFloor; }
+};
+
+// Hotel class with persistence through the shared record store. One Hotel is one property;
+// the original single property keeps the "hotel" store and is the only one that imports the
+// old text files.
+//
+// Every change (room added, booked, canceled) also produces a change event, numbered in the
+// same commit as the change and published once the change is durable: to the in-memory ring
+// that consumers read from any thread, and first to the optional "<store>.events" log. Until
+// that flush, the thread that made a change still sees its event, as Library shows a thread
+// its own writes.
 class Hotel {
 private:
+    string storeName;
+    bool logEvents;
     vector<Room*> rooms;
     vector<Booking*> bookings;
-
-    void saveRooms() const;
-    void loadRooms();
-    void saveBookings() const;
-    void loadBookings();
+    RoomDirectory roomIndex;                // By room number
+    map<string, set<int>> availableByType;  // Free room numbers, keyed by getRoomType()
+    RecordStore store;
+    bool groupCommit = false;
+
+    static constexpr size_t kEventRingSize = 1024;
+    static constexpr size_t kMaxCustomerName = 128;  // Keeps every event within ChangeStream::kMaxEventSize
+    uint64_t nextSequence = 1;
+    vector<ChangeEvent> unpublished;  // Events of committed changes that aren't durable yet
+    size_t loggedEvents = 0;          // How many of them are already in eventLog
+    atomic<uint64_t> flushes{0};      // Successful flushes so far
+
+    // The flush count when a thread last recorded an event; zero-initialized
+    struct OwnEvents {
+        const Hotel* hotel;
+        uint64_t flushes;
+    };
+    inline static thread_local OwnEvents ownEvents;
+    ChangeStream events;
+    unique_ptr<ChangeLog> eventLog;
+
+    void recordEvent(const string& text);
+    void commit();
+    void indexRoom(Room* room);
+    void setAvailability(Room* room, bool availability);
+    void stageRoom(const Room* room);
+    void stageBooking(const Booking* booking);
+    Room* findRoom(int roomNumber) const;
+    void loadLegacyFiles();
 
 public:
+    explicit Hotel(const string& storeName = "hotel", bool logEvents = false)
+        : storeName(storeName), logEvents(logEvents), store(storeName), events(kEventRingSize) {
+        store.setGroupCommit(true);  // commit() decides when to flush, so events go out after their changes
+    }
     ~Hotel();
     void addRoom(Room* room);
-    void bookRoom(int roomNumber, Customer* customer);
-    void cancelBooking(int roomNumber);
-    void checkAvailability(int roomNumber) const;
-    void displayRooms() const;
-    void displayBookings() const;
-    void saveData() const;
+    void bookRoom(int roomNumber, Customer* customer, ostream& out = cout);
+    void cancelBooking(int roomNumber, ostream& out = cout);
+    void checkAvailability(int roomNumber, ostream& out = cout) const;
+    void displayRooms(ostream& out = cout) const;
+    void displayFloor(int floor, ostream& out = cout) const;
+    void displayBookings(ostream& out = cout) const;
+    size_t roomCount() const { return rooms.size(); }
+    size_t availableCount() const;
+    // Up to `limit` free rooms of the type, lowest numbers first
+    vector<int> availableRooms(const string& roomType, size_t limit) const;
+
+    // Appends up to `max` change events from sequence `from` onwards to `out`, from the ring or
+    // else the event log; false if they are no longer kept. Safe to call without the owner's lock,
+    // except while hasOwnUnpublishedEvents(): then this thread's unflushed events are included
+    // too, and the caller must hold the lock.
+    bool readEvents(uint64_t from, size_t max, vector<ChangeEvent>& out) const;
+    uint64_t nextEventSequence() const { return hasOwnUnpublishedEvents() ? nextSequence : events.nextSequence(); }
+    bool hasOwnUnpublishedEvents() const {
+        return ownEvents.hotel == this && ownEvents.flushes == flushes.load(memory_order_acquire);
+    }
+    void saveData();
     void loadData();
+
+    // With group commit on, changes are made durable together by flush() instead of one at
+    // a time; used by the scripted command mode, which flushes before sending any results.
+    void setGroupCommit(bool enabled) { groupCommit = enabled; }
+    void flush();
 };
 
 Hotel::~Hotel() {
+    try {
+        flush();  // Before the store's own final flush, so the events go out with their changes
+    } catch (const exception&) {
+        // Nothing was acknowledged for unflushed group commits, so losing them is allowed.
+    }
     for (auto room : rooms) delete room;
     for (auto booking : bookings) delete booking;
 }
 
 void Hotel::addRoom(Room* room) {
+    static OperationMetric& metric = OperationStats::metric("hotel.addRoom");
+    OperationTimer timer(metric);
+    if (findRoom(room->getRoomNumber())) throw runtime_error("Room already exists.");
     rooms.push_back(room);
+    indexRoom(room);
+    stageRoom(room);
+    recordEvent("room-added " + to_string(room->getRoomNumber()) + " " + room->getRoomType());
+    commit();
 }
 
-void Hotel::bookRoom(int roomNumber, Customer* customer) {
-    for (auto room : rooms) {
-        if (room->getRoomNumber() == roomNumber) {
-            if (room->getAvailability()) {
-                room->setAvailability(false);
-                bookings.push_back(new Booking(room, customer));
-                cout << "Room " << roomNumber << " has been booked for " << customer->getName() << endl;
-                saveBookings();
-                return;
-            } else {
-                throw runtime_error("Room is not available.");
-            }
-        }
+void Hotel::bookRoom(int roomNumber, Customer* customer, ostream& out) {
+    static OperationMetric& metric = OperationStats::metric("hotel.bookRoom");
+    OperationTimer timer(metric);
+    Room* room = findRoom(roomNumber);
+    if (!room) throw runtime_error("Room not found.");
+    if (!room->getAvailability()) throw runtime_error("Room is not available.");
+    if (customer->getName().size() > kMaxCustomerName) throw runtime_error("Customer name too long.");
+    // Booking records and events are space-delimited, so the name must be a single word
+    const string& name = customer->getName();
+    if (name.empty() || any_of(name.begin(), name.end(), [](unsigned char c) { return isspace(c); })) {
+        throw runtime_error("Customer name must be one word.");
     }
-    throw runtime_error("Room not found.");
+    setAvailability(room, false);
+    bookings.push_back(new Booking(room, customer));
+    out << "Room " << roomNumber << " has been booked for " << customer->getName() << endl;
+    stageRoom(room);
+    stageBooking(bookings.back());
+    recordEvent("booked " + to_string(roomNumber) + " " + room->getRoomType() + " " + customer->getName() + " " + to_string(customer->getCustomerID()));
+    commit();
 }
 
-void Hotel::cancelBooking(int roomNumber) {
+void Hotel::cancelBooking(int roomNumber, ostream& out) {
+    static OperationMetric& metric = OperationStats::metric("hotel.cancelBooking");
+    OperationTimer timer(metric);
     for (auto it = bookings.begin(); it != bookings.end(); ++it) {
         if ((*it)->getRoom()->getRoomNumber() == roomNumber) {
-            (*it)->getRoom()->setAvailability(true);
+            Room* room = (*it)->getRoom();
+            const Customer* customer = (*it)->getCustomer();
+            recordEvent("canceled " + to_string(roomNumber) + " " + room->getRoomType() + " " + customer->getName() + " " + to_string(customer->getCustomerID()));
+            setAvailability(room, true);
             delete *it;
             bookings.erase(it);
-            cout << "Booking for room " << roomNumber << " has been canceled." << endl;
-            saveBookings();
+            out << "Booking for room " << roomNumber << " has been canceled." << endl;
+            stageRoom(room);
+            store.erase("booking/" + to_string(roomNumber));
+            commit();
             return;
         }
     }
     throw runtime_error("Booking not found.");
 }
 
-void Hotel::checkAvailability(int roomNumber) const {
+void Hotel::checkAvailability(int roomNumber, ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("hotel.checkAvailability");
+    OperationTimer timer(metric);
+    const Room* room = findRoom(roomNumber);
+    if (room) out << "Room " << roomNumber << " is " << (room->getAvailability() ? "available" : "not available") << endl;
+    else out << "Room not found." << endl;
+}
+
+void Hotel::displayRooms(ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("hotel.displayRooms");
+    OperationTimer timer(metric);
     for (auto room : rooms) {
-        if (room->getRoomNumber() == roomNumber) {
-            cout << "Room " << roomNumber << " is " << (room->getAvailability() ? "available" : "not available") << endl;
-            return;
-        }
+        room->display(out);
     }
-    cout << "Room not found." << endl;
 }
 
-void Hotel::displayRooms() const {
-    for (auto room : rooms) {
-        room->display();
+void Hotel::displayFloor(int floor, ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("hotel.displayFloor");
+    OperationTimer timer(metric);
+    for (auto room : roomIndex.onFloor(floor)) {
+        room->display(out);
     }
 }
 
-void Hotel::displayBookings() const {
+void Hotel::displayBookings(ostream& out) const {
+    static OperationMetric& metric = OperationStats::metric("hotel.displayBookings");
+    OperationTimer timer(metric);
     for (auto booking : bookings) {
-        cout << "Room: " << booking->getRoom()->getRoomNumber() << ", Customer: " << booking->getCustomer()->getName() << endl;
+        out << "Room: " << booking->getRoom()->getRoomNumber() << ", Customer: " << booking->getCustomer()->getName() << endl;
     }
 }
 
-void Hotel::saveRooms() const {
-    ofstream roomFile("rooms.txt");
-    for (auto room : rooms) {
-        roomFile << room->getRoomNumber() << " " << room->getRoomType() << " " << room->getAvailability() << endl;
+// Records are stored in the same space-delimited form the text files used:
+//   room/<number>    -> type availability
+//   booking/<number> -> customerName customerID
+//   events/next      -> sequence number of the next change event
+void Hotel::stageRoom(const Room* room) {
+    store.put("room/" + to_string(room->getRoomNumber()), room->getRoomType() + " " + to_string(room->getAvailability()));
+}
+
+void Hotel::stageBooking(const Booking* booking) {
+    store.put("booking/" + to_string(booking->getRoom()->getRoomNumber()),
+              booking->getCustomer()->getName() + " " + to_string(booking->getCustomer()->getCustomerID()));
+}
+
+// Numbers the event and stages the new position with the change it describes
+void Hotel::recordEvent(const string& text) {
+    unpublished.push_back(ChangeEvent{ nextSequence++, to_string(time(nullptr)) + " " + text });
+    store.put("events/next", to_string(nextSequence));
+    ownEvents = OwnEvents{ this, flushes.load(memory_order_relaxed) };
+}
+
+void Hotel::commit() {
+    store.commit();
+    if (!groupCommit) flush();
+}
+
+// The event log is synced before the store, so it never lacks a durable change (and lines for
+// changes that didn't become durable are cut off when it is next opened); the ring only ever
+// sees durable changes. If either fails, the events are kept to retry; those already logged
+// are not logged again.
+void Hotel::flush() {
+    if (eventLog && loggedEvents < unpublished.size()) {
+        eventLog->append(vector<ChangeEvent>(unpublished.begin() + loggedEvents, unpublished.end()));
     }
+    loggedEvents = unpublished.size();
+    store.flush();
+    for (const ChangeEvent& event : unpublished) events.publish(event);
+    unpublished.clear();
+    loggedEvents = 0;
+    flushes.fetch_add(1, memory_order_release);
+}
+
+bool Hotel::readEvents(uint64_t from, size_t max, vector<ChangeEvent>& out) const {
+    size_t before = out.size();
+    if (!events.read(from, max, out) && !(eventLog && eventLog->read(from, max, out))) return false;
+    if (hasOwnUnpublishedEvents()) {
+        uint64_t next = out.size() > before ? out.back().sequence + 1 : from;
+        for (const ChangeEvent& event : unpublished) {
+            if (out.size() - before >= max) break;
+            if (event.sequence >= next) out.push_back(event);
+        }
+    }
+    return true;
+}
+
+Room* Hotel::findRoom(int roomNumber) const {
+    return roomIndex.find(roomNumber);
+}
+
+void Hotel::indexRoom(Room* room) {
+    roomIndex.add(room);
+    if (room->getAvailability()) availableByType[room->getRoomType()].insert(room->getRoomNumber());
+}
+
+// Every availability change goes through here to keep availableByType in step
+void Hotel::setAvailability(Room* room, bool availability) {
+    room->setAvailability(availability);
+    set<int>& available = availableByType[room->getRoomType()];
+    if (availability) available.insert(room->getRoomNumber());
+    else available.erase(room->getRoomNumber());
+}
+
+size_t Hotel::availableCount() const {
+    size_t count = 0;
+    for (const auto& entry : availableByType) count += entry.second.size();
+    return count;
+}
+
+vector<int> Hotel::availableRooms(const string& roomType, size_t limit) const {
+    vector<int> found;
+    auto it = availableByType.find(roomType);
+    if (it == availableByType.end()) return found;
+    for (auto room = it->second.begin(); room != it->second.end() && found.size() < limit; ++room) found.push_back(*room);
+    return found;
 }
 
-void Hotel::loadRooms() {
+// Every change is committed as it happens; saving folds the log into a fresh checkpoint.
+void Hotel::saveData() {
+    static OperationMetric& metric = OperationStats::metric("hotel.saveData");
+    OperationTimer timer(metric);
+    flush();
+    store.checkpoint();
+}
+
+// Load data from the record store, importing the old text files the first time it is used
+void Hotel::loadData() {
+    static OperationMetric& metric = OperationStats::metric("hotel.loadData");
+    OperationTimer timer(metric);
+    const RecordStore::RecoveryStats& stats = store.recoveryStats();
+    if (stats.bytesDiscarded || stats.corruptPages) {
+        cerr << "Warning: recovered hotel store, discarded " << stats.bytesDiscarded << " bytes of incomplete log and "
+             << stats.corruptPages << " corrupt pages" << endl;
+    }
+
+    string next;
+    if (store.get("events/next", next)) nextSequence = stoull(next);
+    events.resumeAt(nextSequence);
+    if (logEvents) eventLog.reset(new ChangeLog(storeName + ".events", nextSequence));
+
+    if (store.empty()) {
+        if (storeName == "hotel") loadLegacyFiles();
+        return;
+    }
+
+    store.forEachPrefix("room/", [this](const string& key, const string& value) {
+        istringstream fields(value);
+        string roomType;
+        bool availability;
+        if (!(fields >> roomType >> availability)) return;
+        Room* room = makeRoom(roomType, stoi(key.substr(key.find('/') + 1)));
+        if (room) {
+            room->setAvailability(availability);
+            rooms.push_back(room);
+            indexRoom(room);
+        }
+    });
+
+    store.forEachPrefix("booking/", [this](const string& key, const string& value) {
+        istringstream fields(value);
+        string customerName;
+        int customerID;
+        Room* bookedRoom = findRoom(stoi(key.substr(key.find('/') + 1)));
+        if (bookedRoom && fields >> customerName >> customerID) {
+            bookings.push_back(new Booking(bookedRoom, new Customer(customerName, customerID)));
+        }
+    });
+}
+
+// Import rooms.txt and bookings.txt into an empty store
+void Hotel::loadLegacyFiles() {
     ifstream roomFile("rooms.txt");
     int roomNumber;
     string roomType;
     bool availability;
     while (roomFile >> roomNumber >> roomType >> availability) {
-        Room* room = nullptr;
-        if (roomType == "Single") {
-            room = new SingleRoom(roomNumber);
-        } else if (roomType == "Double") {
-            room = new DoubleRoom(roomNumber);
-        } else if (roomType == "Suite") {
-            room = new SuiteRoom(roomNumber);
-        }
+        Room* room = makeRoom(roomType, roomNumber);
         if (room) {
             room->setAvailability(availability);
-            addRoom(room);
+            rooms.push_back(room);
+            indexRoom(room);
+            stageRoom(room);
         }
     }
-}
 
-void Hotel::saveBookings() const {
-    ofstream bookingFile("bookings.txt");
-    for (auto booking : bookings) {
-        bookingFile << booking->getRoom()->getRoomNumber() << " " << booking->getCustomer()->getName() << " " << booking->getCustomer()->getCustomerID() << endl;
-    }
-}
-
-void Hotel::loadBookings() {
     ifstream bookingFile("bookings.txt");
-    int roomNumber;
     string customerName;
     int customerID;
     while (bookingFile >> roomNumber >> customerName >> customerID) {
-        Room* bookedRoom = nullptr;
-        Customer* customer = new Customer(customerName, customerID);
+        Room* bookedRoom = findRoom(roomNumber);
+        if (bookedRoom) {
+            bookings.push_back(new Booking(bookedRoom, new Customer(customerName, customerID)));
+            stageBooking(bookings.back());
+        }
+    }
+
+    commit();
+}
+
+// Hosts many properties in one process. Each property is a shard: a Hotel with its own record
+// store ("hotel-<id>") and indexes behind its own lock, so requests for different properties
+// run in parallel on the server's workers. The property "main" is the original single hotel
+// and keeps the "hotel" store. Which properties exist, and their cities, is kept in a small
+// catalog store ("hotels"); its lock is only held exclusively while adding a property.
+// Setting HOTEL_EVENT_LOG=1 gives every property a tailable "<store>.events" change log.
+class HotelChain {
+public:
+    static constexpr const char* kMainProperty = "main";
 
-        // Find the room from the room list
-        for (auto room : rooms) {
-            if (room->getRoomNumber() == roomNumber) {
-                bookedRoom = room;
+    HotelChain();
+
+    // Adds a property in `city`, or moves an existing one there
+    void setProperty(const string& id, const string& city);
+
+    // Runs `operation` on the property's Hotel while holding that property's lock
+    template <class Operation>
+    void withProperty(const string& id, Operation operation) {
+        shared_lock<shared_mutex> catalogLock(catalogMutex);
+        Property& property = find(id);
+        lock_guard<mutex> lock(property.access);
+        property.dirty.store(true, memory_order_relaxed);  // Published by the unlock
+        operation(*property.hotel);
+    }
+
+    struct FreeRoom {
+        string property;
+        int roomNumber;
+    };
+    // Up to `limit` free rooms of the type across the city's properties, asked in parallel
+    vector<FreeRoom> findAvailable(const string& city, const string& roomType, size_t limit);
+
+    void displayProperties(ostream& out = cout);
+
+    // Change events of one property; these only take the property's lock to include the calling
+    // thread's own unflushed events
+    bool readEvents(const string& id, uint64_t from, size_t max, vector<ChangeEvent>& out);
+    uint64_t nextEventSequence(const string& id);
+
+    void setGroupCommit(bool enabled);
+    void flush();
+    void saveData();
+
+private:
+    struct Property {
+        string id;
+        string city;
+        unique_ptr<Hotel> hotel;
+        mutex access;
+        atomic<bool> dirty{false};  // Changed since the last flush(); set and cleared under `access`
+    };
+
+    static constexpr size_t kPropertiesPerWorker = 64;
+
+    shared_mutex catalogMutex;
+    map<string, unique_ptr<Property>> properties;  // By id
+    multimap<string, Property*> byCity;
+    RecordStore catalog;
+    bool groupCommit = false;
+    bool logEvents;
+
+    Property& find(const string& id);
+    void locate(const string& id, const string& city);
+};
+
+HotelChain::HotelChain() : catalog("hotels") {
+    const char* eventLog = getenv("HOTEL_EVENT_LOG");
+    logEvents = eventLog && *eventLog && string(eventLog) != "0";
+    locate(kMainProperty, "");
+    catalog.forEachPrefix("property/", [this](const string& key, const string& city) { locate(key.substr(key.find('/') + 1), city); });
+}
+
+HotelChain::Property& HotelChain::find(const string& id) {
+    auto it = properties.find(id);
+    if (it == properties.end()) throw runtime_error("Property not found: " + id);
+    return *it->second;
+}
+
+// Opens the property if it isn't open yet, and files it under `city`
+void HotelChain::locate(const string& id, const string& city) {
+    auto it = properties.find(id);
+    if (it == properties.end()) {
+        unique_ptr<Property> property(new Property());
+        property->id = id;
+        property->hotel.reset(new Hotel(id == kMainProperty ? "hotel" : "hotel-" + id, logEvents));
+        property->hotel->loadData();
+        property->hotel->setGroupCommit(groupCommit);
+        it = properties.emplace(id, move(property)).first;
+    } else {
+        for (auto entry = byCity.equal_range(it->second->city); entry.first != entry.second; ++entry.first) {
+            if (entry.first->second == it->second.get()) {
+                byCity.erase(entry.first);
                 break;
             }
         }
+    }
+    it->second->city = city;
+    byCity.emplace(city, it->second.get());
+}
 
-        if (bookedRoom) {
-            bookings.push_back(new Booking(bookedRoom, customer));
-        } else {
-            delete customer; // Clean up if no room found
+void HotelChain::setProperty(const string& id, const string& city) {
+    static OperationMetric& metric = OperationStats::metric("hotel.setProperty");
+    OperationTimer timer(metric);
+    // Ids name the property's files
+    if (id.empty() || id.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != string::npos) {
+        throw runtime_error("Invalid property id: " + id);
+    }
+    unique_lock<shared_mutex> catalogLock(catalogMutex);
+    locate(id, city);
+    catalog.put("property/" + id, city);
+    catalog.commit();
+    catalog.flush();  // Rare, and the new property's files already exist
+}
+
+// The city's properties are split into one contiguous range per worker; each worker asks its
+// properties in turn, taking one property lock at a time, and the results are merged by
+// property id. Small cities are asked on the calling thread.
+vector<HotelChain::FreeRoom> HotelChain::findAvailable(const string& city, const string& roomType, size_t limit) {
+    static OperationMetric& metric = OperationStats::metric("hotel.findAvailable");
+    OperationTimer timer(metric);
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    vector<Property*> candidates;
+    for (auto range = byCity.equal_range(city); range.first != range.second; ++range.first) candidates.push_back(range.first->second);
+    sort(candidates.begin(), candidates.end(), [](const Property* a, const Property* b) { return a->id < b->id; });
+
+    size_t n = candidates.size();
+    size_t workers = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), n / kPropertiesPerWorker));
+    size_t chunk = (n + workers - 1) / workers;
+    vector<vector<FreeRoom>> found(workers);
+    auto ask = [&](size_t w) {
+        for (size_t i = w * chunk; i < min(n, (w + 1) * chunk) && found[w].size() < limit; ++i) {
+            lock_guard<mutex> lock(candidates[i]->access);
+            for (int roomNumber : candidates[i]->hotel->availableRooms(roomType, limit - found[w].size())) {
+                found[w].push_back(FreeRoom{ candidates[i]->id, roomNumber });
+            }
         }
+    };
+    if (workers == 1) {
+        ask(0);
+    } else {
+        vector<thread> threads;
+        for (size_t w = 0; w < workers; ++w) threads.emplace_back(ask, w);
+        for (auto& worker : threads) worker.join();
     }
+
+    vector<FreeRoom> merged;
+    for (const vector<FreeRoom>& part : found) {
+        for (const FreeRoom& room : part) {
+            if (merged.size() == limit) return merged;
+            merged.push_back(room);
+        }
+    }
+    return merged;
 }
 
-void Hotel::saveData() const {
-    saveRooms();
-    saveBookings();
+void HotelChain::displayProperties(ostream& out) {
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    for (const auto& entry : properties) {
+        Property& property = *entry.second;
+        lock_guard<mutex> lock(property.access);
+        out << "Property: " << property.id << ", City: " << (property.city.empty() ? "-" : property.city) << ", Rooms: "
+            << property.hotel->roomCount() << ", Available: " << property.hotel->availableCount() << endl;
+    }
 }
 
-void Hotel::loadData() {
-    loadRooms();
-    loadBookings();
+bool HotelChain::readEvents(const string& id, uint64_t from, size_t max, vector<ChangeEvent>& out) {
+    static OperationMetric& metric = OperationStats::metric("hotel.readEvents");
+    OperationTimer timer(metric);
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    Property& property = find(id);
+    if (!property.hotel->hasOwnUnpublishedEvents()) return property.hotel->readEvents(from, max, out);
+    lock_guard<mutex> lock(property.access);
+    return property.hotel->readEvents(from, max, out);
+}
+
+uint64_t HotelChain::nextEventSequence(const string& id) {
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    Property& property = find(id);
+    if (!property.hotel->hasOwnUnpublishedEvents()) return property.hotel->nextEventSequence();
+    lock_guard<mutex> lock(property.access);
+    return property.hotel->nextEventSequence();
+}
+
+void HotelChain::setGroupCommit(bool enabled) {
+    unique_lock<shared_mutex> catalogLock(catalogMutex);
+    groupCommit = enabled;
+    for (auto& entry : properties) entry.second->hotel->setGroupCommit(enabled);
+}
+
+// Flushes the properties changed since the last flush. A property is marked clean only once its
+// flush has finished, under its lock, so a caller that sees it clean knows its changes are durable.
+void HotelChain::flush() {
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    for (auto& entry : properties) {
+        Property& property = *entry.second;
+        if (!property.dirty.load(memory_order_acquire)) continue;
+        lock_guard<mutex> lock(property.access);
+        property.hotel->flush();
+        property.dirty.store(false, memory_order_release);
+    }
+}
+
+void HotelChain::saveData() {
+    shared_lock<shared_mutex> catalogLock(catalogMutex);
+    for (auto& entry : properties) {
+        lock_guard<mutex> lock(entry.second->access);
+        entry.second->hotel->saveData();
+    }
+}
+
+// Commands for the scripted mode, e.g. "book 101 kabir 7" or "book paris-1 101 kabir 7".
+// Commands on one property take its id as an optional first argument; without it they act on
+// the main property, as they did before there were several.
+void registerCommands(CommandProcessor& commands, HotelChain& chain) {
+    auto addPropertyCommand = [&commands, &chain](const string& name, const string& usage, size_t argCount,
+                                                  function<void(Hotel&, const vector<string>&, ostream&)> handler) {
+        commands.add(name, "[property] " + usage, argCount, argCount + 1, [&chain, argCount, handler](const vector<string>& args, ostream& out) {
+            if (args.size() == argCount) {
+                chain.withProperty(HotelChain::kMainProperty, [&](Hotel& hotel) { handler(hotel, args, out); });
+                return;
+            }
+            vector<string> rest(args.begin() + 1, args.end());
+            chain.withProperty(args[0], [&](Hotel& hotel) { handler(hotel, rest, out); });
+        });
+    };
+
+    addPropertyCommand("add-room", "<room> <single|double|suite>", 2, [](Hotel& hotel, const vector<string>& args, ostream&) {
+        int num = CommandProcessor::toInt(args[0]);
+        string type = args[1];
+        if (!type.empty()) type[0] = static_cast<char>(toupper(static_cast<unsigned char>(type[0])));
+        Room* room = makeRoom(type, num);
+        if (!room) throw runtime_error("Invalid type.");
+        try {
+            hotel.addRoom(room);
+        } catch (...) {
+            delete room;
+            throw;
+        }
+    });
+    addPropertyCommand("book", "<room> <customer-name> <customer-id>", 3, [](Hotel& hotel, const vector<string>& args, ostream& out) {
+        int num = CommandProcessor::toInt(args[0]);
+        Customer* customer = new Customer(args[1], CommandProcessor::toInt(args[2]));
+        try {
+            hotel.bookRoom(num, customer, out);
+        } catch (...) {
+            delete customer;
+            throw;
+        }
+    });
+    addPropertyCommand("cancel", "<room>", 1, [](Hotel& hotel, const vector<string>& args, ostream& out) {
+        hotel.cancelBooking(CommandProcessor::toInt(args[0]), out);
+    });
+    addPropertyCommand("availability", "<room>", 1, [](Hotel& hotel, const vector<string>& args, ostream& out) {
+        hotel.checkAvailability(CommandProcessor::toInt(args[0]), out);
+    });
+    addPropertyCommand("rooms", "", 0, [](Hotel& hotel, const vector<string>&, ostream& out) { hotel.displayRooms(out); });
+    addPropertyCommand("floor", "<floor>", 1, [](Hotel& hotel, const vector<string>& args, ostream& out) {
+        hotel.displayFloor(CommandProcessor::toInt(args[0]), out);
+    });
+    addPropertyCommand("bookings", "", 0, [](Hotel& hotel, const vector<string>&, ostream& out) { hotel.displayBookings(out); });
+
+    commands.add("set-property", "<property> <city>", 2, [&chain](const vector<string>& args, ostream&) { chain.setProperty(args[0], args[1]); });
+    commands.add("properties", "", 0, [&chain](const vector<string>&, ostream& out) { chain.displayProperties(out); });
+    commands.add("find-free", "<city> <single|double|suite> [limit]", 2, 3, [&chain](const vector<string>& args, ostream& out) {
+        string type = args[1];
+        if (!type.empty()) type[0] = static_cast<char>(toupper(static_cast<unsigned char>(type[0])));
+        int limit = args.size() > 2 ? CommandProcessor::toInt(args[2]) : 10;
+        if (limit <= 0) throw runtime_error("Limit must be positive.");
+        for (const HotelChain::FreeRoom& room : chain.findAvailable(args[0], type, limit)) {
+            out << "Property: " << room.property << ", Room: " << room.roomNumber << endl;
+        }
+    });
+    // A consumer keeps the sequence after the last event it handled and asks for the events from
+    // there. One that has fallen too far behind re-reads the state instead: it takes the position
+    // first, so events that race with the re-read are seen again rather than missed.
+    commands.add("events", "<property> <from-sequence> [max]", 2, 3, [&chain](const vector<string>& args, ostream& out) {
+        size_t parsed = 0;
+        uint64_t from = 0;
+        try {
+            from = stoull(args[1], &parsed);
+        } catch (const exception&) {
+        }
+        if (from == 0 || parsed != args[1].size()) throw runtime_error("Invalid sequence: " + args[1]);
+        int max = args.size() > 2 ? CommandProcessor::toInt(args[2]) : 100;
+        if (max <= 0) throw runtime_error("Max must be positive.");
+        vector<ChangeEvent> events;
+        if (!chain.readEvents(args[0], from, max, events)) throw runtime_error("Event " + args[1] + " is no longer available.");
+        for (const ChangeEvent& event : events) out << event.sequence << ' ' << event.text << '\n';
+    });
+    commands.add("event-position", "<property>", 1, [&chain](const vector<string>& args, ostream& out) {
+        out << chain.nextEventSequence(args[0]) << '\n';
+    });
+    commands.add("stats", "", 0, [](const vector<string>&, ostream& out) { OperationStats::dump(out); });
+}
+
+// Non-interactive mode: answers commands from a script file, or from stdin when no file is given
+int runScript(HotelChain& chain, const char* path) {
+    CommandProcessor commands;
+    registerCommands(commands, chain);
+    chain.setGroupCommit(true);
+    commands.setFlushHook([&chain]() { chain.flush(); });
+
+    ios::sync_with_stdio(false);  // Lets the processor see how much piped input is already buffered
+    if (!path) {
+        commands.run(cin, cout);
+        return 0;
+    }
+    ifstream script(path);
+    if (!script) {
+        cerr << "Unable to open script " << path << endl;
+        return 1;
+    }
+    commands.run(script, cout);
+    return 0;
+}
+
+// Service mode: answers clients on a Unix domain socket until SIGINT or SIGTERM
+int runServer(HotelChain& chain, const char* socketPath, size_t workers) {
+    CommandProcessor commands;
+    registerCommands(commands, chain);
+    chain.setGroupCommit(true);
+    commands.setFlushHook([&chain]() { chain.flush(); });
+
+    try {
+        CommandServer server(commands, socketPath, workers, false);  // Each property has its own lock
+        cout << "Serving on " << socketPath << " with " << workers << " workers" << endl;
+        server.run();
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
 }
 
 // Simple user interface
@@ -259,7 +858,14 @@ void userInterface(Hotel& hotel) {
                     case 3: room = new SuiteRoom(num); break;
                     default: cout << "Invalid type." << endl; break;
                 }
-                if (room) hotel.addRoom(room);
+                if (room) {
+                    try {
+                        hotel.addRoom(room);
+                    } catch (const runtime_error& e) {
+                        delete room;
+                        cout << "Error: " << e.what() << endl;
+                    }
+                }
                 break;
             }
             case 2: {
@@ -312,16 +918,42 @@ void userInterface(Hotel& hotel) {
     }
 }
 
-int main() {
-    Hotel hotel;
+int main(int argc, char* argv[]) {
+    OperationStats::dumpAtExitIfRequested();  // OPERATION_STATS=<file> dumps timings at exit
 
-    hotel.loadData();  // Load data from files at the start
+    // "--serve <socket> [workers]" defaults to one worker per core
+    size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), CommandServer::kMaxWorkers);
+    if (argc > 3 && string(argv[1]) == "--serve" && !CommandServer::parseWorkerCount(argv[3], workers)) {
+        cerr << "Usage: " << argv[0] << " --serve <socket> [workers]   (workers: 1 to " << CommandServer::kMaxWorkers << ")" << endl;
+        return 1;
+    }
 
-    // Simple user interface to interact with the hotel system
-    userInterface(hotel);
+    // Opening a store fails if another process has it open
+    try {
+        HotelChain chain;  // Loads every property's data at the start
 
-    hotel.saveData();  // Save data to files before exiting
+        // "--script [file]" runs commands from the file (or stdin) instead of the menu
+        if (argc > 1 && string(argv[1]) == "--script") {
+            int status = runScript(chain, argc > 2 ? argv[2] : nullptr);
+            chain.saveData();
+            return status;
+        }
 
-    return 0;
-}
+        // "--serve <socket> [workers]" answers the same commands over a Unix domain socket
+        if (argc > 2 && string(argv[1]) == "--serve") {
+            int status = runServer(chain, argv[2], workers);
+            chain.saveData();
+            return status;
+        }
 
+        // Simple user interface to interact with the main property
+        chain.withProperty(HotelChain::kMainProperty, [](Hotel& hotel) { userInterface(hotel); });
+
+        chain.saveData();  // Save data to files before exiting
+
+        return 0;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+}
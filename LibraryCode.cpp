@@ -5,266 +5,1498 @@
 #include <sstream>
 #include <stdexcept>
 #include <algorithm>
+#include <map>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <string_view>
+#include <set>
+#include <ctime>
+#include <optional>
+#include <queue>
+#include <unordered_map>
+#include <functional>
+#include <exception>
+#include <atomic>
+
+#include <thread>
+#include "CommandProtocol.h"
+#include "CommandServer.h"
+#include "OperationStats.h"
+#include "PersistentMap.h"
+#include "RecordStore.h"
 
 using namespace std;
 
+// Append-only arena for catalog text. Bytes are copied into large blocks that are never moved
+// or freed, so the views handed out stay valid for the life of the process and can be read
+// from any thread without locking. Only interning takes the pool's mutex.
+//
+// Text is interned by content, so the arena grows with the distinct strings seen rather than
+// with request volume: repeated requests, duplicate import rows and reloaded history all reuse
+// the copy made the first time.
+class StringPool {
+public:
+    // Returns the pooled copy of `text`, copying it into the arena if it isn't there yet.
+    string_view intern(string_view text) {
+        lock_guard<mutex> lock(poolMutex);
+        auto it = interned.find(text);
+        if (it != interned.end()) return *it;
+        string_view stored = append(text);
+        interned.insert(stored);
+        return stored;
+    }
+
+    // The pool shared by every Book and Member.
+    static StringPool& catalog() {
+        static StringPool pool;
+        return pool;
+    }
+
+private:
+    static constexpr size_t kBlockSize = 1 << 20;
+
+    vector<unique_ptr<char[]>> blocks;
+    char* next = nullptr;
+    size_t remaining = 0;
+    unordered_set<string_view> interned;
+    mutex poolMutex;
+
+    string_view append(string_view text) {
+        if (text.empty()) return string_view();
+        if (text.size() > remaining) {
+            // Oversized strings get a block of their own so the current block isn't abandoned.
+            if (text.size() > kBlockSize / 4) {
+                blocks.emplace_back(new char[text.size()]);
+                memcpy(blocks.back().get(), text.data(), text.size());
+                return string_view(blocks.back().get(), text.size());
+            }
+            blocks.emplace_back(new char[kBlockSize]);
+            next = blocks.back().get();
+            remaining = kBlockSize;
+        }
+        memcpy(next, text.data(), text.size());
+        string_view stored(next, text.size());
+        next += text.size();
+        remaining -= text.size();
+        return stored;
+    }
+};
+
+// Titles and authors live in the catalog StringPool; a Book only holds views into it,
+// so copying a Book (or returning its fields) never copies string data.
 class Book {
 public:
-    Book(int id, const string& title, const string& author)
-        : id(id), title(title), author(author), available(true) {}
+    Book(int id, string_view title, string_view author)
+        : id(id), title(StringPool::catalog().intern(storable(title))), author(StringPool::catalog().intern(storable(author))), available(true) {}
 
     int getId() const { return id; }
-    string getTitle() const { return title; }
-    string getAuthor() const { return author; }
+    string_view getTitle() const { return title; }
+    string_view getAuthor() const { return author; }
     bool isAvailable() const { return available; }
     void setAvailable(bool status) { available = status; }
 
 private:
     int id;
-    string title;
-    string author;
+    string_view title;
+    string_view author;
     bool available;
+
+    // Book records are comma-separated, so a comma inside a field would corrupt the record.
+    // Checked before the text is pooled, so a rejected book adds nothing to the pool.
+    static string_view storable(string_view text) {
+        if (text.find(',') != string_view::npos) throw runtime_error("Title and author cannot contain commas");
+        return text;
+    }
 };
 
 class Member {
 public:
-    Member(int id, const string& name) : id(id), name(name) {}
+    Member(int id, string_view name) : id(id), name(StringPool::catalog().intern(name)) {}
 
     int getId() const { return id; }
-    string getName() const { return name; }
+    string_view getName() const { return name; }
 
 private:
     int id;
-    string name;
+    string_view name;
 };
 
 class Loan {
 public:
-    Loan(int bookId, int memberId) : bookId(bookId), memberId(memberId) {}
+    static constexpr time_t kLoanPeriod = 14 * 24 * 60 * 60;  // Two weeks
+
+    Loan(int bookId, int memberId, time_t issuedAt, time_t dueAt)
+        : bookId(bookId), memberId(memberId), issuedAt(issuedAt), dueAt(dueAt) {}
 
     int getBookId() const { return bookId; }
     int getMemberId() const { return memberId; }
+    time_t getIssuedAt() const { return issuedAt; }
+    time_t getDueAt() const { return dueAt; }
 
 private:
     int bookId;
     int memberId;
+    time_t issuedAt;
+    time_t dueAt;
 };
 
-class Library {
+string formatDate(time_t time) {
+    char buffer[16];
+    tm local;
+    localtime_r(&time, &local);  // Reentrant: snapshot readers call this from many threads at once
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d", &local);
+    return buffer;
+}
+
+// Records are shared immutably between snapshots, so a handle stays valid (and unchanged)
+// for as long as the caller holds it, regardless of later writes to the library.
+typedef shared_ptr<const Book> BookHandle;
+typedef shared_ptr<const Member> MemberHandle;
+
+enum class BookOrder { ById, ByTitle, ByAuthor };
+
+// Resume point for cursor-based browsing: the sort key and id of the last book already returned.
+// A default-constructed cursor starts from the beginning of the index.
+struct BrowseCursor {
+    string key;
+    int id = numeric_limits<int>::min();
+};
+
+struct BookPage {
+    vector<BookHandle> books;
+    BrowseCursor next;     // Pass back to browseBooks to fetch the following page
+    bool hasMore = false;
+};
+
+// Parses one line in the books.txt format ("id,title,author,available"). Returns nullptr for
+// malformed lines. A trailing '\r' from CRLF files is ignored.
+BookHandle parseBookLine(const string& line) {
+    size_t end = line.size();
+    if (end && line[end - 1] == '\r') --end;
+    size_t titleStart = line.find(',');
+    size_t authorStart = titleStart < end ? line.find(',', titleStart + 1) : string::npos;
+    if (authorStart >= end) return nullptr;
+    size_t availableStart = line.find(',', authorStart + 1);
+    size_t authorEnd = min(availableStart, end);
+
+    int id;
+    try {
+        size_t parsed;
+        id = stoi(line.substr(0, titleStart), &parsed);
+        if (parsed != titleStart) return nullptr;
+    } catch (const exception&) {
+        return nullptr;
+    }
+    string_view text(line);
+    auto book = make_shared<Book>(id, text.substr(titleStart + 1, authorStart - titleStart - 1),
+                                  text.substr(authorStart + 1, authorEnd - authorStart - 1));
+    book->setAvailable(availableStart < end && line.compare(availableStart + 1, end - availableStart - 1, "1") == 0);
+    return book;
+}
+
+string formatBookLine(const Book& book) {
+    ostringstream out;
+    out << book.getId() << ',' << book.getTitle() << ',' << book.getAuthor() << ',' << (book.isAvailable() ? "1" : "0");
+    return out.str();
+}
+
+// members.txt format: "id,name"
+MemberHandle parseMemberLine(const string& line) {
+    size_t comma = line.find(',');
+    if (comma == string::npos) return nullptr;
+    size_t end = line.size();
+    if (end > comma + 1 && line[end - 1] == '\r') --end;
+    try {
+        return make_shared<const Member>(stoi(line.substr(0, comma)), string_view(line).substr(comma + 1, end - comma - 1));
+    } catch (const exception&) {
+        return nullptr;
+    }
+}
+
+string formatMemberLine(const Member& member) {
+    ostringstream out;
+    out << member.getId() << ',' << member.getName();
+    return out.str();
+}
+
+// loans.txt format: "bookId,memberId,issuedAt,dueAt". Files written before loans had dates
+// only hold the first two fields; those loans are treated as issued at `defaultIssuedAt`.
+optional<Loan> parseLoanLine(const string& line, time_t defaultIssuedAt) {
+    istringstream iss(line);
+    int bookId, memberId;
+    long long issuedAt, dueAt;
+    char comma;
+    if (!(iss >> bookId >> comma >> memberId)) return nullopt;
+    if (!(iss >> comma >> issuedAt >> comma >> dueAt)) {
+        issuedAt = defaultIssuedAt;
+        dueAt = defaultIssuedAt + Loan::kLoanPeriod;
+    }
+    return Loan(bookId, memberId, issuedAt, dueAt);
+}
+
+string formatLoanLine(const Loan& loan) {
+    ostringstream out;
+    out << loan.getBookId() << ',' << loan.getMemberId() << ',' << loan.getIssuedAt() << ',' << loan.getDueAt();
+    return out.str();
+}
+
+// Lower-cased, whitespace-collapsed "title|author" used to detect the same book under a different id.
+string normalizedBookKey(const Book& book) {
+    string key;
+    for (string_view field : { book.getTitle(), book.getAuthor() }) {
+        bool pendingSpace = false;
+        for (char c : field) {
+            if (isspace(static_cast<unsigned char>(c))) {
+                pendingSpace = true;
+                continue;
+            }
+            if (pendingSpace && !key.empty() && key.back() != '|') key += ' ';
+            pendingSpace = false;
+            key += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+        key += '|';
+    }
+    return key;
+}
+
+struct ImportReport {
+    size_t imported = 0;
+    size_t malformed = 0;
+    size_t duplicateId = 0;
+    size_t duplicateTitleAuthor = 0;
+    vector<pair<size_t, string>> rejectedSamples;  // (line number, reason), first kMaxSamples only
+    double seconds = 0;
+
+    static constexpr size_t kMaxSamples = 20;
+
+    size_t rejected() const { return malformed + duplicateId + duplicateTitleAuthor; }
+
+    void reject(size_t lineNumber, size_t& counter, const char* reason) {
+        ++counter;
+        if (rejectedSamples.size() < kMaxSamples) rejectedSamples.emplace_back(lineNumber, reason);
+    }
+
+    void display() const {
+        size_t rows = imported + rejected();
+        cout << "Imported " << imported << " of " << rows << " rows in " << seconds << "s";
+        if (seconds > 0) cout << " (" << static_cast<long long>(rows / seconds) << " rows/s)";
+        cout << "\nRejected: " << malformed << " malformed, " << duplicateId << " duplicate ID, "
+             << duplicateTitleAuthor << " duplicate title/author\n";
+        for (const auto& sample : rejectedSamples) {
+            cout << "  line " << sample.first << ": " << sample.second << '\n';
+        }
+    }
+};
+
+// An immutable, consistent view of the library. Readers obtain one from Library::snapshot()
+// and can use it from any thread without locking; writers never modify a published snapshot.
+class LibrarySnapshot {
 public:
-    Book* getBookById(int bookId) {
-        return findBook(bookId);
+    static constexpr size_t kPageSize = 50;
+
+    BookHandle getBookById(int bookId) const {
+        const BookHandle* book = books.get(bookId);
+        return book ? *book : nullptr;
+    }
+
+    MemberHandle getMemberById(int memberId) const {
+        const MemberHandle* member = members.get(memberId);
+        return member ? *member : nullptr;
+    }
+
+    // Returns up to `limit` books that sort strictly after `after` in the requested order.
+    // Costs O(log n + limit): one index seek followed by a walk over the page.
+    BookPage browseBooks(BookOrder order, const BrowseCursor& after, size_t limit, bool availableOnly = false) const {
+        static OperationMetric& metric = OperationStats::metric("library.browseBooks");
+        OperationTimer timer(metric);
+        const BookIndex& index = (availableOnly ? availableIndex : bookIndex)[static_cast<int>(order)];
+        BookPage page;
+        page.next = after;
+        auto it = index.upper_bound(IndexKey(after.key, after.id));
+        for (; it != index.end() && page.books.size() < limit; ++it) {
+            page.books.push_back(it->second);
+        }
+        if (!page.books.empty()) {
+            const BookHandle& last = page.books.back();
+            page.next.key = string(indexKey(*last, order).first);
+            page.next.id = last->getId();
+        }
+        page.hasMore = it != index.end();
+        return page;
+    }
+
+    // Members and loans are keyed by id, so their cursor is simply the last id returned.
+    vector<MemberHandle> browseMembers(int afterId, size_t limit) const {
+        vector<MemberHandle> page;
+        for (auto it = members.upper_bound(afterId); it != members.end() && page.size() < limit; ++it) {
+            page.push_back(it->second);
+        }
+        return page;
+    }
+
+    vector<Loan> browseLoans(int afterBookId, size_t limit) const {
+        vector<Loan> page;
+        for (auto it = loans.upper_bound(afterBookId); it != loans.end() && page.size() < limit; ++it) {
+            page.push_back(it->second);
+        }
+        return page;
+    }
+
+    // The display functions walk the indexes page by page and write each page to `out` in one go.
+    void displayBooks(ostream& out = cout) const {
+        if (books.empty()) {
+            out << "No books available.\n";
+            return;
+        }
+        out << "Books:\n";
+        BookPage page;
+        do {
+            page = browseBooks(BookOrder::ById, page.next, kPageSize);
+            printBooks(page.books, out);
+        } while (page.hasMore);
+    }
+
+    void displayMembers(ostream& out = cout) const {
+        if (members.empty()) {
+            out << "No members available.\n";
+            return;
+        }
+        out << "Members:\n";
+        int afterId = numeric_limits<int>::min();
+        vector<MemberHandle> page;
+        while (!(page = browseMembers(afterId, kPageSize)).empty()) {
+            ostringstream buffer;
+            for (const auto& member : page) {
+                buffer << "ID: " << member->getId() << ", Name: " << member->getName() << '\n';
+            }
+            out << buffer.str();
+            afterId = page.back()->getId();
+        }
     }
-    void addBook(const Book& book) { books.push_back(book); }
+
+    void displayLoans(ostream& out = cout) const {
+        if (loans.empty()) {
+            out << "No loans recorded.\n";
+            return;
+        }
+        out << "Loans:\n";
+        int afterBookId = numeric_limits<int>::min();
+        vector<Loan> page;
+        while (!(page = browseLoans(afterBookId, kPageSize)).empty()) {
+            ostringstream buffer;
+            for (const Loan& loan : page) {
+                buffer << "Book ID: " << loan.getBookId() << ", Member ID: " << loan.getMemberId()
+                       << ", Due: " << formatDate(loan.getDueAt()) << '\n';
+            }
+            out << buffer.str();
+            afterBookId = page.back().getBookId();
+        }
+    }
+
+    // Loans due before `now`, earliest first. Walks the due-date index from its front and stops
+    // at the first loan that isn't overdue, so it costs O(k log n) for k overdue loans.
+    vector<Loan> overdueLoans(time_t now) const {
+        static OperationMetric& metric = OperationStats::metric("library.overdueLoans");
+        OperationTimer timer(metric);
+        vector<Loan> overdue;
+        for (auto it = dueIndex.begin(); it != dueIndex.end() && it->first.first < now; ++it) {
+            overdue.push_back(it->second);
+        }
+        return overdue;
+    }
+
+    void displayOverdueLoans(time_t now, ostream& out = cout) const {
+        vector<Loan> overdue = overdueLoans(now);
+        if (overdue.empty()) {
+            out << "No overdue loans.\n";
+            return;
+        }
+        ostringstream buffer;
+        buffer << "Overdue Loans:\n";
+        for (const Loan& loan : overdue) {
+            buffer << "Book ID: " << loan.getBookId() << ", Member ID: " << loan.getMemberId()
+                   << ", Due: " << formatDate(loan.getDueAt()) << ", Days Overdue: " << (now - loan.getDueAt()) / (24 * 60 * 60) << '\n';
+        }
+        out << buffer.str();
+    }
+
+    static void printBooks(const vector<BookHandle>& page, ostream& out = cout) {
+        ostringstream buffer;
+        for (const auto& book : page) {
+            buffer << "ID: " << book->getId() << ", Title: " << book->getTitle() << ", Author: " << book->getAuthor()
+                   << ", Available: " << (book->isAvailable() ? "Yes" : "No") << '\n';
+        }
+        out << buffer.str();
+    }
+
+private:
+    friend class Library;
+
+    // Every collection is a PersistentMap, so copying a snapshot for a write copies only their
+    // roots and the write rebuilds just the O(log n) nodes it touches; the rest stays shared.
+    //
+    // Secondary indexes map (sort key, book id) to the book; the id breaks ties between equal keys.
+    // Keys are views into the string pool, so an index entry costs no string storage of its own.
+    typedef pair<string_view, int> IndexKey;
+    typedef PersistentMap<IndexKey, BookHandle> BookIndex;
+    typedef PersistentMap<int, BookHandle> BookMap;
+
+    BookMap books;
+    PersistentMap<int, MemberHandle> members;
+    PersistentMap<int, Loan> loans;  // Keyed by book id; a book has at most one active loan
+    // (due time, book id) -> loan, for every active loan. Ordered like a min-heap on due time,
+    // but also supports removing a returned loan directly.
+    PersistentMap<pair<time_t, int>, Loan> dueIndex;
+
+    BookIndex bookIndex[3];       // All books, one index per BookOrder
+    BookIndex availableIndex[3];  // Available books only, for available-only browsing
+
+    static IndexKey indexKey(const Book& book, BookOrder order) {
+        switch (order) {
+            case BookOrder::ByTitle: return IndexKey(book.getTitle(), book.getId());
+            case BookOrder::ByAuthor: return IndexKey(book.getAuthor(), book.getId());
+            default: return IndexKey(string_view(), book.getId());
+        }
+    }
+
+    void indexBook(const BookHandle& book) {
+        for (int order = 0; order < 3; ++order) {
+            IndexKey key = indexKey(*book, static_cast<BookOrder>(order));
+            bookIndex[order].set(key, book);
+            if (book->isAvailable()) availableIndex[order].set(key, book);
+        }
+    }
+
+    void unindexBook(const Book& book) {
+        for (int order = 0; order < 3; ++order) {
+            IndexKey key = indexKey(book, static_cast<BookOrder>(order));
+            bookIndex[order].erase(key);
+            availableIndex[order].erase(key);
+        }
+    }
+
+    // Records are never modified in place: a changed book is a new record that replaces the old one.
+    void replaceBook(const BookHandle& book) {
+        const BookHandle* old = books.get(book->getId());
+        if (old) unindexBook(**old);
+        books.set(book->getId(), book);
+        indexBook(book);
+    }
+
     void removeBook(int bookId) {
-    // Check if the book is currently issued
-    auto itLoan = find_if(loans.begin(), loans.end(),
-                          [bookId](const Loan& loan) { return loan.getBookId() == bookId; });
+        const BookHandle* old = books.get(bookId);
+        if (!old) return;
+        unindexBook(**old);
+        books.erase(bookId);
+    }
 
-    if (itLoan != loans.end()) {
-        // Book is currently issued
-        cout << "First return the book.\n";
-        return;
+    void addLoan(const Loan& loan) {
+        if (loans.emplace(loan.getBookId(), loan)) dueIndex.set(make_pair(loan.getDueAt(), loan.getBookId()), loan);
     }
 
-    // Remove the book if it is not issued
-    auto itBook = remove_if(books.begin(), books.end(),
-                            [bookId](const Book& book) { return book.getId() == bookId; });
+    void removeLoan(int bookId) {
+        const Loan* loan = loans.get(bookId);
+        if (!loan) return;
+        dueIndex.erase(make_pair(loan->getDueAt(), bookId));
+        loans.erase(bookId);
+    }
 
-    if (itBook != books.end()) {
-        books.erase(itBook, books.end());
+    // Bulk build: sort each index's entries once and build the map from them in one pass,
+    // which is linear. Much cheaper than n individual inserts.
+    void rebuildIndexes() {
+        vector<pair<IndexKey, BookHandle>> entries;
+        vector<pair<IndexKey, BookHandle>> available;
+        entries.reserve(books.size());
+        for (int order = 0; order < 3; ++order) {
+            entries.clear();
+            available.clear();
+            for (const auto& entry : books) {
+                entries.emplace_back(indexKey(*entry.second, static_cast<BookOrder>(order)), entry.second);
+            }
+            if (static_cast<BookOrder>(order) != BookOrder::ById) sort(entries.begin(), entries.end(),
+                [](const pair<IndexKey, BookHandle>& a, const pair<IndexKey, BookHandle>& b) { return a.first < b.first; });
+            for (const auto& entry : entries) {
+                if (entry.second->isAvailable()) available.push_back(entry);
+            }
+            bookIndex[order] = BookIndex::fromSorted(entries.begin(), entries.end());
+            availableIndex[order] = BookIndex::fromSorted(available.begin(), available.end());
+        }
+    }
+};
+
+// One issue or return in the loan history. Issues carry the book's author at the time, so
+// author counts don't shift when a book is later updated or removed.
+struct CirculationEvent {
+    bool returned;
+    int bookId;
+    int memberId;
+    time_t time;         // When the book was issued or returned
+    time_t dueAt;        // Returns only
+    string_view author;  // Issues only; pooled
+};
+
+// History records: "issue,bookId,memberId,issuedAt,author" and "return,bookId,memberId,returnedAt,dueAt".
+string formatCirculationLine(const CirculationEvent& event) {
+    ostringstream out;
+    out << (event.returned ? "return" : "issue") << ',' << event.bookId << ',' << event.memberId << ',' << event.time << ',';
+    if (event.returned) out << event.dueAt;
+    else out << event.author;
+    return out.str();
+}
+
+optional<CirculationEvent> parseCirculationLine(const string& line) {
+    istringstream iss(line);
+    string kind;
+    int bookId, memberId;
+    long long time;
+    char comma;
+    if (!getline(iss, kind, ',') || (kind != "issue" && kind != "return")) return nullopt;
+    if (!(iss >> bookId >> comma >> memberId >> comma >> time >> comma)) return nullopt;
+    CirculationEvent event{ kind == "return", bookId, memberId, static_cast<time_t>(time), 0, string_view() };
+    if (event.returned) {
+        long long dueAt;
+        if (!(iss >> dueAt)) return nullopt;
+        event.dueAt = dueAt;
     } else {
-        throw runtime_error("Book not found");
+        string author;
+        getline(iss, author);
+        event.author = StringPool::catalog().intern(author);
     }
+    return event;
 }
 
+// A count per key, plus the keys ranked by count so the top K are read in O(K) and a change
+// costs O(log n). Equal counts rank by key.
+template <typename Key>
+class RankedCounter {
+public:
+    void add(const Key& key, int64_t delta) {
+        uint64_t& count = counts[key];
+        if (count) ranking.erase(make_pair(count, key));
+        count += delta;
+        if (count) ranking.emplace(count, key);
+        else counts.erase(key);
+    }
 
-    void updateBook(int bookId, const Book& newBook) {
-    // Check if the book is currently issued
-    auto itLoan = find_if(loans.begin(), loans.end(),
-                          [bookId](const Loan& loan) { return loan.getBookId() == bookId; });
+    uint64_t count(const Key& key) const {
+        auto it = counts.find(key);
+        return it != counts.end() ? it->second : 0;
+    }
 
-    if (itLoan != loans.end()) {
-        // Book is currently issued
-        cout << "First return book before updating.\n";
-        return;
+    vector<pair<Key, uint64_t>> top(size_t k) const {
+        vector<pair<Key, uint64_t>> result;
+        for (auto it = ranking.begin(); it != ranking.end() && result.size() < k; ++it) result.emplace_back(it->second, it->first);
+        return result;
+    }
+
+    void clear() {
+        counts.clear();
+        ranking.clear();
+    }
+
+private:
+    struct MostFirst {
+        bool operator()(const pair<uint64_t, Key>& a, const pair<uint64_t, Key>& b) const {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        }
+    };
+
+    unordered_map<Key, uint64_t> counts;
+    set<pair<uint64_t, Key>, MostFirst> ranking;
+};
+
+struct MemberCirculation {
+    uint64_t loans = 0;
+    uint64_t returns = 0;
+    uint64_t lateReturns = 0;
+};
+
+// Circulation aggregates kept up to date from the loan history as it is written, so reports
+// never rescan it: loan counts per book, author and member, and the most-borrowed books over
+// the last kTrendingWindow. Lives outside the snapshots (writes would otherwise copy it) and
+// has its own lock, held only for the O(log n) update or the O(K) query.
+class CirculationStats {
+public:
+    static constexpr time_t kTrendingWindow = 30 * 24 * 60 * 60;  // 30 days
+
+    void record(const vector<CirculationEvent>& events, time_t now) {
+        lock_guard<mutex> lock(statsMutex);
+        for (const CirculationEvent& event : events) apply(event);
+        expire(now);
+    }
+
+    // Starts over from an empty history whose trending window ends at `now`.
+    void reset(time_t now) {
+        lock_guard<mutex> lock(statsMutex);
+        books.clear();
+        authors.clear();
+        members.clear();
+        memberReturns.clear();
+        trending.clear();
+        recentIssues = decltype(recentIssues)();
+        windowStart = now - kTrendingWindow;
+    }
+
+    vector<pair<int, uint64_t>> topBooks(size_t k) const {
+        lock_guard<mutex> lock(statsMutex);
+        return books.top(k);
+    }
+
+    vector<pair<int, uint64_t>> trendingBooks(size_t k, time_t now) {
+        lock_guard<mutex> lock(statsMutex);
+        expire(now);
+        return trending.top(k);
+    }
+
+    vector<pair<string_view, uint64_t>> topAuthors(size_t k) const {
+        lock_guard<mutex> lock(statsMutex);
+        return authors.top(k);
+    }
+
+    vector<pair<int, uint64_t>> topMembers(size_t k) const {
+        lock_guard<mutex> lock(statsMutex);
+        return members.top(k);
+    }
+
+    uint64_t bookLoans(int bookId) const {
+        lock_guard<mutex> lock(statsMutex);
+        return books.count(bookId);
+    }
+
+    uint64_t authorLoans(string_view author) const {
+        lock_guard<mutex> lock(statsMutex);
+        return authors.count(author);
     }
 
-    // Update the book if it is not issued
-    for (auto& book : books) {
-        if (book.getId() == bookId) {
-            book = newBook;
+    MemberCirculation memberCirculation(int memberId) const {
+        lock_guard<mutex> lock(statsMutex);
+        auto it = memberReturns.find(memberId);
+        MemberCirculation result = it != memberReturns.end() ? it->second : MemberCirculation();
+        result.loans = members.count(memberId);
+        return result;
+    }
+
+private:
+    mutable mutex statsMutex;
+    RankedCounter<int> books;
+    RankedCounter<string_view> authors;
+    RankedCounter<int> members;
+    unordered_map<int, MemberCirculation> memberReturns;  // returns and lateReturns only
+    RankedCounter<int> trending;  // Issues since windowStart, per book
+    // (issuedAt, book id) of the issues counted in `trending`; a min-heap so expiry is
+    // O(log n) per issue and tolerates issues recorded out of time order.
+    priority_queue<pair<time_t, int>, vector<pair<time_t, int>>, greater<pair<time_t, int>>> recentIssues;
+    time_t windowStart = 0;
+
+    void apply(const CirculationEvent& event) {
+        if (event.returned) {
+            MemberCirculation& member = memberReturns[event.memberId];
+            ++member.returns;
+            if (event.time > event.dueAt) ++member.lateReturns;
             return;
         }
+        books.add(event.bookId, 1);
+        authors.add(event.author, 1);
+        members.add(event.memberId, 1);
+        if (event.time >= windowStart) {
+            trending.add(event.bookId, 1);
+            recentIssues.emplace(event.time, event.bookId);
+        }
     }
-    throw runtime_error("Book not found");
-}
 
+    void expire(time_t now) {
+        windowStart = max(windowStart, now - kTrendingWindow);
+        while (!recentIssues.empty() && recentIssues.top().first < windowStart) {
+            trending.add(recentIssues.top().second, -1);
+            recentIssues.pop();
+        }
+    }
+};
 
-    void addMember(const Member& member) { members.push_back(member); }
-    void issueBook(int bookId, int memberId) {
-    Book* book = findBook(bookId);
-    Member* member = findMember(memberId);
-    if (!book) throw runtime_error("Book not found");
-    if (!member) throw runtime_error("Member not found");
-    if (!book->isAvailable()) throw runtime_error("Book is not available");
-    book->setAvailable(false);
-    loans.push_back(Loan(bookId, memberId));
-}
+// "Members who borrowed this also borrowed": for each book, the books most often borrowed by
+// the same members. Memory is fixed per book and per member, whatever the catalog size: a new
+// loan pairs only with the member's last kRecentPerMember distinct books, and a book keeps at
+// most kNeighbors co-borrow counters. Once those are full, a new neighbour takes over the
+// smallest counter and continues from its count (the space-saving heavy-hitters scheme), so
+// books borrowed together often always surface; a count may be overstated by what it took over.
+class CoBorrowIndex {
+public:
+    static constexpr size_t kRecentPerMember = 16;
+    static constexpr size_t kNeighbors = 32;
 
-    void returnBook(int bookId) {
-        Book* book = findBook(bookId);
-        if (!book) throw runtime_error("Book not found");
-        auto it = remove_if(loans.begin(), loans.end(),
-                            [bookId](const Loan& loan) { return loan.getBookId() == bookId; });
-        if (it != loans.end()) {
-            book->setAvailable(true);
-            loans.erase(it, loans.end());
+    // Replaces the index with one built from the loan history. Loans are grouped by member
+    // (a member's pairs depend only on their own loans) and the books are split into shards,
+    // each built by one worker, so workers never share anything they write.
+    void rebuild(const vector<CirculationEvent>& history) {
+        vector<pair<int, int>> loans;  // (member id, book id), in history order within a member
+        for (const CirculationEvent& event : history) {
+            if (!event.returned) loans.emplace_back(event.memberId, event.bookId);
+        }
+        stable_sort(loans.begin(), loans.end(), [](const pair<int, int>& a, const pair<int, int>& b) { return a.first < b.first; });
+
+        lock_guard<mutex> lock(indexMutex);
+        for (auto& shard : shards) shard.clear();
+        recent.clear();
+        size_t workers = max<size_t>(1, min<size_t>({ thread::hardware_concurrency(), kShards, loans.size() / kLoansPerWorker }));
+        auto build = [&](size_t w) {
+            RecentBooks books;
+            for (size_t i = 0; i < loans.size(); ++i) {
+                if (i == 0 || loans[i].first != loans[i - 1].first) books = RecentBooks();
+                int book = loans[i].second;
+                if (!books.contains(book)) {
+                    for (size_t j = 0; j < books.size; ++j) {
+                        if (shardOf(book) % workers == w) bump(book, books.books[j]);
+                        if (shardOf(books.books[j]) % workers == w) bump(books.books[j], book);
+                    }
+                    books.add(book);
+                }
+                if (w == 0 && (i + 1 == loans.size() || loans[i + 1].first != loans[i].first)) recent[loans[i].first] = books;
+            }
+        };
+        if (workers == 1) {
+            build(0);
         } else {
-            throw runtime_error("Loan record not found");
+            vector<thread> threads;
+            for (size_t w = 0; w < workers; ++w) threads.emplace_back(build, w);
+            for (auto& worker : threads) worker.join();
         }
     }
 
+    void record(const vector<CirculationEvent>& events) {
+        lock_guard<mutex> lock(indexMutex);
+        for (const CirculationEvent& event : events) {
+            if (event.returned) continue;
+            RecentBooks& books = recent[event.memberId];
+            if (books.contains(event.bookId)) continue;
+            for (size_t j = 0; j < books.size; ++j) {
+                bump(event.bookId, books.books[j]);
+                bump(books.books[j], event.bookId);
+            }
+            books.add(event.bookId);
+        }
+    }
+
+    // Up to `n` (book id, times borrowed together) pairs, most often first.
+    vector<pair<int, uint32_t>> related(int bookId, size_t n) const {
+        vector<pair<int, uint32_t>> result;
+        {
+            lock_guard<mutex> lock(indexMutex);
+            const auto& shard = shards[shardOf(bookId)];
+            auto it = shard.find(bookId);
+            if (it == shard.end()) return result;
+            for (const Neighbor& neighbor : it->second) result.emplace_back(neighbor.bookId, neighbor.count);
+        }
+        n = min(n, result.size());
+        partial_sort(result.begin(), result.begin() + n, result.end(), [](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        result.resize(n);
+        return result;
+    }
 
-    void saveData() const {
-        ofstream bookFile("books.txt");
-        ofstream memberFile("members.txt");
-        ofstream loanFile("loans.txt");
+private:
+    static constexpr size_t kShards = 64;
+    static constexpr size_t kLoansPerWorker = 1 << 16;
 
-        if (!bookFile || !memberFile || !loanFile) throw runtime_error("Unable to open file for writing");
+    struct Neighbor {
+        int bookId;
+        uint32_t count;
+    };
 
-        for (const auto& book : books) {
-            bookFile << book.getId() << ',' << book.getTitle() << ',' << book.getAuthor() << ',' << (book.isAvailable() ? "1" : "0") << '\n';
-        }
+    // A member's last few distinct books, oldest overwritten first
+    struct RecentBooks {
+        int books[kRecentPerMember];
+        uint8_t size = 0;
+        uint8_t next = 0;
 
-        for (const auto& member : members) {
-            memberFile << member.getId() << ',' << member.getName() << '\n';
+        bool contains(int book) const { return find(books, books + size, book) != books + size; }
+
+        void add(int book) {
+            books[next] = book;
+            next = static_cast<uint8_t>((next + 1) % kRecentPerMember);
+            if (size < kRecentPerMember) ++size;
         }
+    };
+
+    mutable mutex indexMutex;
+    vector<unordered_map<int, vector<Neighbor>>> shards = vector<unordered_map<int, vector<Neighbor>>>(kShards);  // By book id
+    unordered_map<int, RecentBooks> recent;  // By member id
 
-        for (const auto& loan : loans) {
-            loanFile << loan.getBookId() << ',' << loan.getMemberId() << '\n';
+    static size_t shardOf(int bookId) { return static_cast<unsigned>(bookId) % kShards; }
+
+    void bump(int bookId, int other) {
+        vector<Neighbor>& neighbors = shards[shardOf(bookId)][bookId];
+        auto smallest = neighbors.end();
+        for (auto it = neighbors.begin(); it != neighbors.end(); ++it) {
+            if (it->bookId == other) {
+                ++it->count;
+                return;
+            }
+            if (smallest == neighbors.end() || it->count < smallest->count) smallest = it;
         }
+        if (neighbors.size() < kNeighbors) neighbors.push_back(Neighbor{ other, 1 });
+        else *smallest = Neighbor{ other, smallest->count + 1 };
     }
+};
 
-    void loadData() {
-    ifstream bookFile("books.txt");
-    ifstream memberFile("members.txt");
-    ifstream loanFile("loans.txt");
-
-    if (!bookFile || !memberFile || !loanFile) throw runtime_error("Unable to open file for reading");
-
-    books.clear();
-    members.clear();
-    loans.clear();
-
-    string line;
-    // Load books
-    while (getline(bookFile, line)) {
-        istringstream iss(line);
-        string token;
-        if (getline(iss, token, ',')) {
-            int id = stoi(token);
-            if (getline(iss, token, ',')) {
-                string title = token;
-                if (getline(iss, token, ',')) {
-                    string author = token;
-                    bool available = (getline(iss, token) && token == "1"); // Read availability status
-                    books.emplace_back(id, title, author);
-                    books.back().setAvailable(available);
+// Writers are serialized and work on a private copy of the latest version, which replaces it
+// when the write (or enclosing WriteBatch) finishes. Readers are never blocked by writers and
+// never observe a half-applied change. The copy shares all but the changed paths of the
+// snapshot's maps, so a write costs O(log n) however large the catalog.
+//
+// Each write also stages its changed records in the "library" record store; the batch commits
+// them as one transaction. A version is only published to readers once that transaction is
+// durable: straight away normally, or by flush() under group commit. Until then only the
+// thread that wrote it sees it, so a command sees its own earlier writes. Issues and returns
+// are also appended to the loan history there, and folded into the circulation stats and
+// co-borrow index when the version that made them is published.
+class Library {
+public:
+    // Groups several writes into a single published version. Each write made while a batch is
+    // open reuses the same working copy. The copy is only taken once a write gets past its
+    // checks, so a rejected write neither copies nor publishes anything.
+    class WriteBatch {
+    public:
+        explicit WriteBatch(Library& library)
+            : library(library), lock(library.writeMutex), base(atomic_load(&library.latest)), exceptionsAtStart(uncaught_exceptions()) {
+            ++library.batchDepth;
+        }
+
+        // The outermost batch commits. If it is unwinding from an exception, the write that threw
+        // may have left the working copy half-changed, so its changes are discarded instead. A
+        // commit that fails is discarded by the store, so the batch is undone here as well and
+        // the error reaches the writer. Under group commit, a failed flush instead leaves the
+        // transactions sealed for the next flush to retry, and their versions unpublished.
+        ~WriteBatch() noexcept(false) {
+            if (--library.batchDepth > 0) return;
+            if (uncaught_exceptions() > exceptionsAtStart) {
+                library.working.reset();
+                library.pendingCirculation.clear();
+                library.store.rollback();
+                return;
+            }
+            shared_ptr<LibrarySnapshot> next = move(library.working);
+            vector<CirculationEvent> circulation;
+            circulation.swap(library.pendingCirculation);
+            shared_ptr<const LibrarySnapshot> previous = atomic_load(&library.latest);
+            size_t unpublishedBefore = library.unpublishedCirculation.size();
+            if (next) atomic_store(&library.latest, shared_ptr<const LibrarySnapshot>(move(next)));
+            library.historySize += circulation.size();
+            library.unpublishedCirculation.insert(library.unpublishedCirculation.end(), circulation.begin(), circulation.end());
+            if (library.groupCommit) {
+                ownWrites = OwnWrites{ &library, library.flushes.load() };
+                library.store.commit();
+            } else {
+                try {
+                    library.store.commit();
+                } catch (const exception&) {
+                    atomic_store(&library.latest, previous);
+                    library.historySize -= circulation.size();
+                    library.unpublishedCirculation.resize(unpublishedBefore);
+                    throw;
                 }
+                library.publishDurable();
             }
         }
+
+        // The library as this batch's writes have left it so far; for checks before changing it
+        const LibrarySnapshot& current() const { return library.working ? *library.working : *base; }
+
+        // The working copy to change, taken on first use
+        LibrarySnapshot& state() {
+            if (!library.working) library.working = make_shared<LibrarySnapshot>(*base);
+            return *library.working;
+        }
+
+        WriteBatch(const WriteBatch&) = delete;
+        WriteBatch& operator=(const WriteBatch&) = delete;
+
+    private:
+        Library& library;
+        lock_guard<recursive_mutex> lock;
+        shared_ptr<const LibrarySnapshot> base;  // Latest version when the batch opened
+        int exceptionsAtStart;
+    };
+
+    Library() : published(make_shared<LibrarySnapshot>()), latest(published), store("library") {}
+
+    // The latest durable version, or the latest version if this thread has written to it since
+    // the last flush.
+    shared_ptr<const LibrarySnapshot> snapshot() const {
+        if (ownWrites.library == this && ownWrites.flushes == flushes.load(memory_order_acquire)) return atomic_load(&latest);
+        return atomic_load(&published);
+    }
+
+    BookHandle getBookById(int bookId) const {
+        static OperationMetric& metric = OperationStats::metric("library.getBookById");
+        OperationTimer timer(metric);
+        return snapshot()->getBookById(bookId);
+    }
+
+    void addBook(const Book& book) {
+        static OperationMetric& metric = OperationStats::metric("library.addBook");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        if (batch.current().books.count(book.getId())) throw runtime_error("Book ID already exists");
+        batch.state().replaceBook(make_shared<const Book>(book));
+        stageBook(book);
+    }
+
+    void removeBook(int bookId) {
+        static OperationMetric& metric = OperationStats::metric("library.removeBook");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        const LibrarySnapshot& current = batch.current();
+        if (current.loans.count(bookId)) throw runtime_error("First return the book.");
+        if (!current.books.count(bookId)) throw runtime_error("Book not found");
+
+        batch.state().removeBook(bookId);
+        store.erase(bookKey(bookId));
+    }
+
+    void updateBook(int bookId, const Book& newBook) {
+        static OperationMetric& metric = OperationStats::metric("library.updateBook");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        const LibrarySnapshot& current = batch.current();
+        if (current.loans.count(bookId)) throw runtime_error("First return book before updating.");
+        if (!current.books.count(bookId)) throw runtime_error("Book not found");
+
+        LibrarySnapshot& state = batch.state();
+        state.removeBook(bookId);
+        store.erase(bookKey(bookId));
+        state.replaceBook(make_shared<const Book>(newBook));
+        stageBook(newBook);
+    }
+
+    void addMember(const Member& member) {
+        static OperationMetric& metric = OperationStats::metric("library.addMember");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        if (batch.current().members.count(member.getId())) throw runtime_error("Member ID already exists");
+        batch.state().members.set(member.getId(), make_shared<const Member>(member));
+        store.put(memberKey(member.getId()), formatMemberLine(member));
     }
 
-    // Load members
-    while (getline(memberFile, line)) {
-        istringstream iss(line);
-        string token;
-        if (getline(iss, token, ',')) {
-            int id = stoi(token);
-            if (getline(iss, token)) {
-                string name = token;
-                members.emplace_back(id, name);
+    void issueBook(int bookId, int memberId, time_t issuedAt = time(nullptr)) {
+        static OperationMetric& metric = OperationStats::metric("library.issueBook");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        const LibrarySnapshot& current = batch.current();
+        BookHandle book = current.getBookById(bookId);
+        if (!book) throw runtime_error("Book not found");
+        if (!current.getMemberById(memberId)) throw runtime_error("Member not found");
+        if (!book->isAvailable()) throw runtime_error("Book is not available");
+        Loan loan(bookId, memberId, issuedAt, issuedAt + Loan::kLoanPeriod);
+        BookHandle issued = withAvailability(*book, false);
+        LibrarySnapshot& state = batch.state();
+        state.replaceBook(issued);
+        state.addLoan(loan);
+        stageBook(*issued);
+        store.put(loanKey(bookId), formatLoanLine(loan));
+        stageCirculation(CirculationEvent{ false, bookId, memberId, issuedAt, 0, book->getAuthor() });
+    }
+
+    void returnBook(int bookId) {
+        static OperationMetric& metric = OperationStats::metric("library.returnBook");
+        OperationTimer timer(metric);
+        WriteBatch batch(*this);
+        const LibrarySnapshot& current = batch.current();
+        BookHandle book = current.getBookById(bookId);
+        if (!book) throw runtime_error("Book not found");
+        const Loan* loan = current.loans.get(bookId);
+        if (!loan) throw runtime_error("Loan record not found");
+        CirculationEvent event{ true, bookId, loan->getMemberId(), time(nullptr), loan->getDueAt(), string_view() };
+        BookHandle returned = withAvailability(*book, true);
+        LibrarySnapshot& state = batch.state();
+        state.replaceBook(returned);
+        state.removeLoan(bookId);
+        stageBook(*returned);
+        store.erase(loanKey(bookId));
+        stageCirculation(event);
+    }
+
+    // Streams a CSV in the books.txt format into the catalog. Rows are rejected if they are
+    // malformed or duplicate an existing (or earlier imported) book by id or by normalized
+    // title/author. Imported books have no loans here, so they all come in available whatever
+    // the availability field says. The whole import is one write batch. A small import is
+    // inserted book by book; a large one rebuilds the maps and indexes in one linear pass.
+    ImportReport importBooks(const string& path) {
+        static OperationMetric& metric = OperationStats::metric("library.importBooks");
+        OperationTimer timer(metric);
+        ifstream file(path);
+        if (!file) throw runtime_error("Unable to open file for reading");
+
+        auto start = chrono::steady_clock::now();
+        ImportReport report;
+        WriteBatch batch(*this);
+        const LibrarySnapshot& current = batch.current();
+
+        unordered_set<string> seenTitleAuthor;
+        seenTitleAuthor.reserve(current.books.size());
+        for (const auto& entry : current.books) seenTitleAuthor.insert(normalizedBookKey(*entry.second));
+        vector<pair<int, BookHandle>> imported;
+        unordered_set<int> importedIds;
+
+        string line;
+        size_t lineNumber = 0;
+        while (getline(file, line)) {
+            ++lineNumber;
+            BookHandle book = parseBookLine(line);
+            if (book && !book->isAvailable()) book = withAvailability(*book, true);
+            if (!book) {
+                report.reject(lineNumber, report.malformed, "malformed row");
+            } else if (current.books.count(book->getId()) || !importedIds.insert(book->getId()).second) {
+                report.reject(lineNumber, report.duplicateId, "duplicate ID");
+            } else if (!seenTitleAuthor.insert(normalizedBookKey(*book)).second) {
+                importedIds.erase(book->getId());
+                report.reject(lineNumber, report.duplicateTitleAuthor, "duplicate title/author");
+            } else {
+                imported.emplace_back(book->getId(), book);
+                stageBook(*book);
+                ++report.imported;
             }
         }
+
+        if (!imported.empty()) {
+            LibrarySnapshot& state = batch.state();
+            if (imported.size() < state.books.size() / kBulkImportFraction) {
+                for (const auto& entry : imported) state.replaceBook(entry.second);
+            } else {
+                // Partner catalogs are usually sorted by id already
+                auto byId = [](const pair<int, BookHandle>& a, const pair<int, BookHandle>& b) { return a.first < b.first; };
+                if (!is_sorted(imported.begin(), imported.end(), byId)) sort(imported.begin(), imported.end(), byId);
+                vector<pair<int, BookHandle>> merged;
+                merged.reserve(state.books.size() + imported.size());
+                merge(state.books.begin(), state.books.end(), imported.begin(), imported.end(), back_inserter(merged), byId);
+                state.books = LibrarySnapshot::BookMap::fromSorted(merged.begin(), merged.end());
+                state.rebuildIndexes();
+            }
+        }
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+    // Every write is already durable; saving folds the store's log into a fresh checkpoint.
+    void saveData() {
+        static OperationMetric& metric = OperationStats::metric("library.saveData");
+        OperationTimer timer(metric);
+        lock_guard<recursive_mutex> lock(writeMutex);
+        flush();
+        store.checkpoint();
     }
 
-    // Load loans
-    while (getline(loanFile, line)) {
-        istringstream iss(line);
-        string token;
-        if (getline(iss, token, ',')) {
-            int bookId = stoi(token);
-            if (getline(iss, token)) {
-                int memberId = stoi(token);
-                loans.emplace_back(bookId, memberId);
+    // Loads the catalog from the record store. The first time the store is used, the old
+    // books.txt, members.txt and loans.txt files (if present) are imported into it.
+    void loadData() {
+        static OperationMetric& metric = OperationStats::metric("library.loadData");
+        OperationTimer timer(metric);
+        lock_guard<recursive_mutex> lock(writeMutex);
+        const RecordStore::RecoveryStats& stats = store.recoveryStats();
+        if (stats.bytesDiscarded || stats.corruptPages) {
+            cerr << "Warning: recovered library store, discarded " << stats.bytesDiscarded << " bytes of incomplete log and "
+                 << stats.corruptPages << " corrupt pages\n";
+        }
+        if (store.empty()) importLegacyFiles();
+
+        auto loaded = make_shared<LibrarySnapshot>();
+        time_t loadedAt = time(nullptr);
+        // Keys sort as text ("book/10" before "book/9"), so records are gathered and sorted by id
+        // before the maps are built from them in one pass.
+        vector<pair<int, BookHandle>> books;
+        store.forEachPrefix("book/", [&](const string&, const string& value) {
+            BookHandle book = parseBookLine(value);
+            if (book) books.emplace_back(book->getId(), book);
+        });
+        loaded->books = LibrarySnapshot::BookMap::fromSorted(books.begin(), sortedById(books));
+        vector<pair<int, MemberHandle>> members;
+        store.forEachPrefix("member/", [&](const string&, const string& value) {
+            MemberHandle member = parseMemberLine(value);
+            if (member) members.emplace_back(member->getId(), member);
+        });
+        loaded->members = PersistentMap<int, MemberHandle>::fromSorted(members.begin(), sortedById(members));
+        store.forEachPrefix("loan/", [&](const string&, const string& value) {
+            optional<Loan> loan = parseLoanLine(value, loadedAt);
+            if (loan) loaded->addLoan(*loan);
+        });
+        loaded->rebuildIndexes();
+
+        vector<CirculationEvent> history;
+        store.forEachPrefix("history/", [&](const string&, const string& value) {
+            optional<CirculationEvent> event = parseCirculationLine(value);
+            if (event) history.push_back(*event);
+        });
+        historySize = history.size();
+        // Loans from before the history was kept start it off, so they are counted too.
+        if (history.empty() && !loaded->loans.empty()) {
+            for (const auto& entry : loaded->loans) {
+                BookHandle book = loaded->getBookById(entry.first);
+                history.push_back(CirculationEvent{ false, entry.first, entry.second.getMemberId(), entry.second.getIssuedAt(), 0,
+                                                    book ? book->getAuthor() : string_view() });
+                store.put(historyKey(historySize++), formatCirculationLine(history.back()));
             }
+            store.commit();
         }
+        circulation.reset(loadedAt);
+        circulation.record(history, loadedAt);
+        coBorrowed.rebuild(history);
+
+        atomic_store(&latest, shared_ptr<const LibrarySnapshot>(loaded));
+        publishDurable();
     }
-}
 
-    void displayBooks() const {
-    if (books.empty()) {
-        cout << "No books available.\n";
-        return;
+    // Circulation reports. Each is O(K) in the number of entries shown.
+    void displayTopBooks(size_t k, ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.topBooks");
+        OperationTimer timer(metric);
+        printBookLoans(circulation.topBooks(k), out);
     }
-    cout << "Books:\n";
-    for (const auto& book : books) {
-        cout << "ID: " << book.getId() << ", Title: " << book.getTitle() << ", Author: " << book.getAuthor()
-             << ", Available: " << (book.isAvailable() ? "Yes" : "No") << '\n';
+
+    void displayTrendingBooks(size_t k, ostream& out = cout) {
+        static OperationMetric& metric = OperationStats::metric("library.trendingBooks");
+        OperationTimer timer(metric);
+        printBookLoans(circulation.trendingBooks(k, time(nullptr)), out);
     }
-}
 
+    void displayTopAuthors(size_t k, ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.topAuthors");
+        OperationTimer timer(metric);
+        for (const auto& entry : circulation.topAuthors(k)) out << "Author: " << entry.first << ", Loans: " << entry.second << '\n';
+    }
 
-    void displayMembers() const {
-        if (members.empty()) {
-            cout << "No members available.\n";
-            return;
-        }
-        cout << "Members:\n";
-        for (const auto& member : members) {
-            cout << "ID: " << member.getId() << ", Name: " << member.getName() << '\n';
+    void displayTopMembers(size_t k, ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.topMembers");
+        OperationTimer timer(metric);
+        shared_ptr<const LibrarySnapshot> current = snapshot();
+        for (const auto& entry : circulation.topMembers(k)) {
+            MemberHandle member = current->getMemberById(entry.first);
+            out << "ID: " << entry.first << ", Name: " << (member ? member->getName() : string_view("(removed)"))
+                << ", Loans: " << entry.second << '\n';
         }
     }
 
-    void displayLoans() const {
-        if (loans.empty()) {
-            cout << "No loans recorded.\n";
-            return;
-        }
-        cout << "Loans:\n";
-        for (const auto& loan : loans) {
-            cout << "Book ID: " << loan.getBookId() << ", Member ID: " << loan.getMemberId() << '\n';
+    // Books most often borrowed by members who also borrowed `bookId`.
+    void displayRelatedBooks(int bookId, size_t n, ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.relatedBooks");
+        OperationTimer timer(metric);
+        shared_ptr<const LibrarySnapshot> current = snapshot();
+        for (const auto& entry : coBorrowed.related(bookId, n)) {
+            BookHandle book = current->getBookById(entry.first);
+            out << "ID: " << entry.first << ", Title: " << (book ? book->getTitle() : string_view("(removed)"))
+                << ", Borrowed together: " << entry.second << '\n';
         }
     }
 
+    uint64_t bookLoans(int bookId) const { return circulation.bookLoans(bookId); }
+    uint64_t authorLoans(string_view author) const { return circulation.authorLoans(author); }
+    MemberCirculation memberCirculation(int memberId) const { return circulation.memberCirculation(memberId); }
+
+    void displayBooks(ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.displayBooks");
+        OperationTimer timer(metric);
+        snapshot()->displayBooks(out);
+    }
+
+    void displayMembers(ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.displayMembers");
+        OperationTimer timer(metric);
+        snapshot()->displayMembers(out);
+    }
+
+    void displayLoans(ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.displayLoans");
+        OperationTimer timer(metric);
+        snapshot()->displayLoans(out);
+    }
+
+    void displayOverdueLoans(ostream& out = cout) const {
+        static OperationMetric& metric = OperationStats::metric("library.displayOverdueLoans");
+        OperationTimer timer(metric);
+        snapshot()->displayOverdueLoans(time(nullptr), out);
+    }
+
+    // With group commit on, writes are made durable together by flush() instead of one at
+    // a time, and other threads see them only after that; used by the command modes, which
+    // flush before sending any results.
+    void setGroupCommit(bool enabled) {
+        lock_guard<recursive_mutex> lock(writeMutex);
+        store.setGroupCommit(enabled);
+        groupCommit = enabled;
+        if (!enabled) publishDurable();
+    }
+
+    // Makes every committed write durable, then publishes the latest version to readers.
+    void flush() {
+        lock_guard<recursive_mutex> lock(writeMutex);
+        store.flush();
+        publishDurable();
+    }
+
 private:
-    vector<Book> books;
-    vector<Member> members;
-    vector<Loan> loans;
+    // The flush count when a thread last committed a write under group commit; zero-initialized
+    struct OwnWrites {
+        const Library* library;
+        uint64_t flushes;
+    };
+    inline static thread_local OwnWrites ownWrites;
+
+    shared_ptr<const LibrarySnapshot> published;  // Durable version for readers; only ever accessed through atomic_load/atomic_store
+    shared_ptr<const LibrarySnapshot> latest;     // Newest committed version, durable or not; accessed the same way
+    shared_ptr<LibrarySnapshot> working;          // Writer-private copy while a WriteBatch is open
+    recursive_mutex writeMutex;                   // Recursive so public writes can nest inside a WriteBatch
+    int batchDepth = 0;
+    bool groupCommit = false;
+    atomic<uint64_t> flushes{0};  // Times the latest version has been published
+    RecordStore store;  // Only touched while holding writeMutex
+    uint64_t historySize = 0;                       // Committed history records; writer only
+    vector<CirculationEvent> pendingCirculation;    // Staged by the open WriteBatch
+    vector<CirculationEvent> unpublishedCirculation;  // Committed but not yet durable
+    CirculationStats circulation;
+    CoBorrowIndex coBorrowed;
+
+    // Records are stored in the same comma-separated form as the old text files.
+    static string bookKey(int bookId) { return "book/" + to_string(bookId); }
+    static string memberKey(int memberId) { return "member/" + to_string(memberId); }
+    static string loanKey(int bookId) { return "loan/" + to_string(bookId); }
 
-    Book* findBook(int bookId) {
-        for (auto& book : books) {
-            if (book.getId() == bookId) return &book;
+    // Imports smaller than 1/kBulkImportFraction of the catalog are inserted book by book
+    static constexpr size_t kBulkImportFraction = 16;
+
+    // Sorts records by id and drops any repeated id, keeping the first; returns the new end.
+    template <typename Handle>
+    static typename vector<pair<int, Handle>>::iterator sortedById(vector<pair<int, Handle>>& records) {
+        stable_sort(records.begin(), records.end(), [](const pair<int, Handle>& a, const pair<int, Handle>& b) { return a.first < b.first; });
+        return unique(records.begin(), records.end(), [](const pair<int, Handle>& a, const pair<int, Handle>& b) { return a.first == b.first; });
+    }
+    // Zero-padded so the history reads back in order
+    static string historyKey(uint64_t sequence) {
+        string number = to_string(sequence);
+        return "history/" + string(number.size() < 12 ? 12 - number.size() : 0, '0') + number;
+    }
+
+    // Called with writeMutex held, once everything committed so far is durable
+    void publishDurable() {
+        atomic_store(&published, atomic_load(&latest));
+        if (!unpublishedCirculation.empty()) {
+            circulation.record(unpublishedCirculation, time(nullptr));
+            coBorrowed.record(unpublishedCirculation);
+            unpublishedCirculation.clear();
         }
-        return nullptr;
+        flushes.fetch_add(1, memory_order_release);
     }
 
-    Member* findMember(int memberId) {
-        for (auto& member : members) {
-            if (member.getId() == memberId) return &member;
+    void stageBook(const Book& book) { store.put(bookKey(book.getId()), formatBookLine(book)); }
+
+    void stageCirculation(const CirculationEvent& event) {
+        store.put(historyKey(historySize + pendingCirculation.size()), formatCirculationLine(event));
+        pendingCirculation.push_back(event);
+    }
+
+    void printBookLoans(const vector<pair<int, uint64_t>>& counts, ostream& out) const {
+        shared_ptr<const LibrarySnapshot> current = snapshot();
+        for (const auto& entry : counts) {
+            BookHandle book = current->getBookById(entry.first);
+            out << "ID: " << entry.first << ", Title: " << (book ? book->getTitle() : string_view("(removed)"))
+                << ", Loans: " << entry.second << '\n';
         }
-        return nullptr;
     }
 
-    Loan* findLoan(int bookId, int memberId) {
-        for (auto& loan : loans) {
-            if (loan.getBookId() == bookId && loan.getMemberId() == memberId) return &loan;
+    void importLegacyFiles() {
+        ifstream bookFile("books.txt");
+        ifstream memberFile("members.txt");
+        ifstream loanFile("loans.txt");
+        time_t loadedAt = time(nullptr);
+
+        string line;
+        while (getline(bookFile, line)) {
+            BookHandle book = parseBookLine(line);
+            if (book) stageBook(*book);
         }
-        return nullptr;
+        while (getline(memberFile, line)) {
+            MemberHandle member = parseMemberLine(line);
+            if (member) store.put(memberKey(member->getId()), formatMemberLine(*member));
+        }
+        while (getline(loanFile, line)) {
+            optional<Loan> loan = parseLoanLine(line, loadedAt);
+            if (loan) store.put(loanKey(loan->getBookId()), formatLoanLine(*loan));
+        }
+        store.commit();
+    }
+
+    static BookHandle withAvailability(const Book& book, bool available) {
+        auto updated = make_shared<Book>(book);
+        updated->setAvailable(available);
+        return updated;
     }
 };
 
+// Interactive cursor browsing: shows one page at a time until the user stops or the index is exhausted.
+// All pages come from the same snapshot, so concurrent issues and returns don't shift the listing.
+void browseCatalog(const Library& library) {
+    int orderChoice;
+    char filter;
+    cout << "Order by (1: ID, 2: Title, 3: Author): ";
+    cin >> orderChoice;
+    cout << "Available books only? (y/n): ";
+    cin >> filter;
+    if (orderChoice < 1 || orderChoice > 3) {
+        cout << "Invalid order.\n";
+        return;
+    }
+
+    shared_ptr<const LibrarySnapshot> view = library.snapshot();
+    BookOrder order = static_cast<BookOrder>(orderChoice - 1);
+    BookPage page;
+    while (true) {
+        page = view->browseBooks(order, page.next, LibrarySnapshot::kPageSize, filter == 'y' || filter == 'Y');
+        if (page.books.empty()) {
+            cout << "No more books.\n";
+            return;
+        }
+        LibrarySnapshot::printBooks(page.books);
+        if (!page.hasMore) return;
+        char next;
+        cout << "Next page? (y/n): ";
+        cin >> next;
+        if (next != 'y' && next != 'Y') return;
+    }
+}
+
+// Commands for the scripted mode, e.g. add-book 5 "The Hobbit" "J. R. R. Tolkien"
+void registerCommands(CommandProcessor& commands, Library& library) {
+    commands.add("add-book", "<id> <title> <author>", 3, [&library](const vector<string>& args, ostream&) {
+        library.addBook(Book(CommandProcessor::toInt(args[0]), args[1], args[2]));
+    });
+    commands.add("remove-book", "<id>", 1, [&library](const vector<string>& args, ostream&) {
+        library.removeBook(CommandProcessor::toInt(args[0]));
+    });
+    commands.add("update-book", "<id> <title> <author>", 3, [&library](const vector<string>& args, ostream&) {
+        int id = CommandProcessor::toInt(args[0]);
+        library.updateBook(id, Book(id, args[1], args[2]));
+    });
+    commands.add("add-member", "<id> <name>", 2, [&library](const vector<string>& args, ostream&) {
+        library.addMember(Member(CommandProcessor::toInt(args[0]), args[1]));
+    });
+    commands.add("issue", "<book-id> <member-id>", 2, [&library](const vector<string>& args, ostream&) {
+        library.issueBook(CommandProcessor::toInt(args[0]), CommandProcessor::toInt(args[1]));
+    });
+    commands.add("return", "<book-id>", 1, [&library](const vector<string>& args, ostream&) {
+        library.returnBook(CommandProcessor::toInt(args[0]));
+    });
+    commands.add("books", "", 0, [&library](const vector<string>&, ostream& out) { library.displayBooks(out); });
+    commands.add("members", "", 0, [&library](const vector<string>&, ostream& out) { library.displayMembers(out); });
+    commands.add("loans", "", 0, [&library](const vector<string>&, ostream& out) { library.displayLoans(out); });
+    commands.add("overdue", "", 0, [&library](const vector<string>&, ostream& out) { library.displayOverdueLoans(out); });
+
+    // One page per request; when more remain, the last data line is the cursor for the next page:
+    //   next "<key>" <id>
+    commands.add("browse", "<id|title|author> <all|available> <limit> [<after-key> <after-id>]", 3, 5,
+                 [&library](const vector<string>& args, ostream& out) {
+        const string orders[] = { "id", "title", "author" };
+        int order = static_cast<int>(find(begin(orders), end(orders), args[0]) - begin(orders));
+        if (order == 3) throw runtime_error("Invalid order: " + args[0]);
+        if (args[1] != "all" && args[1] != "available") throw runtime_error("Invalid filter: " + args[1]);
+        int limit = CommandProcessor::toInt(args[2]);
+        if (limit <= 0) throw runtime_error("Invalid limit: " + args[2]);
+        BrowseCursor after;
+        if (args.size() == 5) {
+            after.key = args[3];
+            after.id = CommandProcessor::toInt(args[4]);
+        } else if (args.size() != 3) {
+            throw runtime_error("Cursor needs both <after-key> and <after-id>");
+        }
+
+        BookPage page = library.snapshot()->browseBooks(static_cast<BookOrder>(order), after, limit, args[1] == "available");
+        LibrarySnapshot::printBooks(page.books, out);
+        if (page.hasMore) out << "next " << CommandProcessor::quote(page.next.key) << ' ' << page.next.id << '\n';
+    });
+    // Circulation reports; [k] is how many entries to list (default 10).
+    auto topCount = [](const vector<string>& args) -> size_t {
+        if (args.empty()) return 10;
+        int k = CommandProcessor::toInt(args[0]);
+        if (k <= 0) throw runtime_error("Invalid count: " + args[0]);
+        return static_cast<size_t>(k);
+    };
+    commands.add("top-books", "[k]", 0, 1, [&library, topCount](const vector<string>& args, ostream& out) {
+        library.displayTopBooks(topCount(args), out);
+    });
+    commands.add("trending-books", "[k]", 0, 1, [&library, topCount](const vector<string>& args, ostream& out) {
+        library.displayTrendingBooks(topCount(args), out);
+    });
+    commands.add("top-authors", "[k]", 0, 1, [&library, topCount](const vector<string>& args, ostream& out) {
+        library.displayTopAuthors(topCount(args), out);
+    });
+    commands.add("top-members", "[k]", 0, 1, [&library, topCount](const vector<string>& args, ostream& out) {
+        library.displayTopMembers(topCount(args), out);
+    });
+    commands.add("related", "<book-id> [n]", 1, 2, [&library](const vector<string>& args, ostream& out) {
+        int n = args.size() > 1 ? CommandProcessor::toInt(args[1]) : 5;
+        if (n <= 0) throw runtime_error("Invalid count: " + args[1]);
+        library.displayRelatedBooks(CommandProcessor::toInt(args[0]), static_cast<size_t>(n), out);
+    });
+    commands.add("circulation", "<book|member|author> <id|author>", 2, [&library](const vector<string>& args, ostream& out) {
+        if (args[0] == "book") {
+            out << "loans " << library.bookLoans(CommandProcessor::toInt(args[1])) << '\n';
+        } else if (args[0] == "author") {
+            out << "loans " << library.authorLoans(args[1]) << '\n';
+        } else if (args[0] == "member") {
+            MemberCirculation member = library.memberCirculation(CommandProcessor::toInt(args[1]));
+            out << "loans " << member.loans << " returns " << member.returns << " late " << member.lateReturns << '\n';
+        } else {
+            throw runtime_error("Invalid kind: " + args[0]);
+        }
+    });
+    commands.add("import", "<csv-path>", 1, [&library](const vector<string>& args, ostream& out) {
+        ImportReport report = library.importBooks(args[0]);
+        out << "imported " << report.imported << " rejected " << report.rejected() << " seconds " << report.seconds << '\n';
+    });
+    commands.add("stats", "", 0, [](const vector<string>&, ostream& out) { OperationStats::dump(out); });
+}
+
+// Non-interactive mode: answers commands from a script file, or from stdin when no file is given
+int runScript(Library& library, const char* path) {
+    CommandProcessor commands;
+    registerCommands(commands, library);
+    library.setGroupCommit(true);
+    commands.setFlushHook([&library]() { library.flush(); });
+
+    ios::sync_with_stdio(false);  // Lets the processor see how much piped input is already buffered
+    if (!path) {
+        commands.run(cin, cout);
+        return 0;
+    }
+    ifstream script(path);
+    if (!script) {
+        cerr << "Unable to open script " << path << endl;
+        return 1;
+    }
+    commands.run(script, cout);
+    return 0;
+}
+
+// Service mode: answers clients on a Unix domain socket until SIGINT or SIGTERM
+int runServer(Library& library, const char* socketPath, size_t workers) {
+    CommandProcessor commands;
+    registerCommands(commands, library);
+    library.setGroupCommit(true);
+    commands.setFlushHook([&library]() { library.flush(); });
+
+    try {
+        CommandServer server(commands, socketPath, workers, false);  // Reads run on snapshots and writes take the library's own lock
+        cout << "Serving on " << socketPath << " with " << workers << " workers" << endl;
+        server.run();
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
 void userInterface(Library& library) {
     while (true) {
         cout << "\nLibrary Management System\n";
@@ -278,6 +1510,9 @@ void userInterface(Library& library) {
         cout << "8. View All Members\n";
         cout << "9. View All Loans\n";
         cout << "10. Exit\n";
+        cout << "11. Browse Books\n";
+        cout << "12. Import Books\n";
+        cout << "13. View Overdue Loans\n";
         cout << "Enter choice: ";
         int choice;
         cin >> choice;
@@ -313,7 +1548,7 @@ void userInterface(Library& library) {
                     cin.ignore();
 
                     // Check if the book is issued
-                    Book* existingBook = library.getBookById(id);
+                    BookHandle existingBook = library.getBookById(id);
                     if (existingBook) {
                         // Book found, check if it's available
                         if (!existingBook->isAvailable()) {
@@ -372,6 +1607,19 @@ void userInterface(Library& library) {
                     break;
                 case 10:
                     return;
+                case 11:
+                    browseCatalog(library);
+                    break;
+                case 12: {
+                    string path;
+                    cout << "Enter CSV file path: ";
+                    getline(cin, path);
+                    library.importBooks(path).display();
+                    break;
+                }
+                case 13:
+                    library.displayOverdueLoans();
+                    break;
                 default:
                     cout << "Invalid choice, please try again.\n";
                     break;
@@ -382,14 +1630,43 @@ void userInterface(Library& library) {
     }
 }
 
-int main() {
-    Library library;
+int main(int argc, char* argv[]) {
+    OperationStats::dumpAtExitIfRequested();  // OPERATION_STATS=<file> dumps timings at exit
 
-    library.loadData();  // Load data from files
+    // "--serve <socket> [workers]" defaults to one worker per core
+    size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), CommandServer::kMaxWorkers);
+    if (argc > 3 && string(argv[1]) == "--serve" && !CommandServer::parseWorkerCount(argv[3], workers)) {
+        cerr << "Usage: " << argv[0] << " --serve <socket> [workers]   (workers: 1 to " << CommandServer::kMaxWorkers << ")" << endl;
+        return 1;
+    }
 
-    userInterface(library);
+    // Opening a store fails if another process has it open
+    try {
+        Library library;
 
-    library.saveData();  // Save data to files
+        library.loadData();  // Load data from files
 
-    return 0;
+        // "--script [file]" runs commands from the file (or stdin) instead of the menu
+        if (argc > 1 && string(argv[1]) == "--script") {
+            int status = runScript(library, argc > 2 ? argv[2] : nullptr);
+            library.saveData();
+            return status;
+        }
+
+        // "--serve <socket> [workers]" answers the same commands over a Unix domain socket
+        if (argc > 2 && string(argv[1]) == "--serve") {
+            int status = runServer(library, argv[2], workers);
+            library.saveData();
+            return status;
+        }
+
+        userInterface(library);
+
+        library.saveData();  // Save data to files
+
+        return 0;
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
 }
@@ -0,0 +1,277 @@
+// An ordered map whose copies share structure, for the Library's copy-on-write snapshots.
+//
+// Nodes are immutable and reference counted. Copying a map copies only its root pointer, and
+// an insert or erase builds new nodes along one root-to-leaf path (an AVL tree, so O(log n)
+// of them) while every untouched subtree stays shared with the versions that came before.
+// A version is never changed once other copies of it exist, so readers on other threads can
+// walk an old version while a writer builds the next one.
+//
+// The read side mirrors std::map (find, count, at, lower_bound, upper_bound, forward
+// iteration); writes are set, emplace and erase by key. Iterators stay valid for as long as
+// the map they came from (or any copy of it) is alive and unchanged.
+
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class PersistentMap {
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+
+public:
+    typedef std::pair<const Key, Value> value_type;
+
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef PersistentMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        reference operator*() const { return path.back()->entry; }
+        pointer operator->() const { return &path.back()->entry; }
+
+        const_iterator& operator++() {
+            const Node* node = path.back();
+            if (node->right) {
+                pushLeftmost(node->right.get());
+            } else {
+                // Climb until we leave a left subtree; that parent is next
+                const Node* child;
+                do {
+                    child = path.back();
+                    path.pop_back();
+                } while (!path.empty() && path.back()->right.get() == child);
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return path.empty() ? other.path.empty() : !other.path.empty() && path.back() == other.path.back();
+        }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class PersistentMap;
+        std::vector<const Node*> path;  // From the root down to the current node; empty at end()
+
+        void pushLeftmost(const Node* node) {
+            for (; node; node = node->left.get()) path.push_back(node);
+        }
+    };
+    typedef const_iterator iterator;
+
+    PersistentMap() = default;
+
+    // Builds a balanced map in O(n) from entries sorted by key, with no key repeated.
+    template <typename Iterator>
+    static PersistentMap fromSorted(Iterator first, Iterator last) {
+        PersistentMap map;
+        map.entries = static_cast<size_t>(std::distance(first, last));
+        map.root = build(first, map.entries);
+        return map;
+    }
+
+    size_t size() const { return entries; }
+    bool empty() const { return entries == 0; }
+
+    // The value for `key`, or nullptr. Cheaper than find() when no iterator is needed.
+    const Value* get(const Key& key) const {
+        const Node* node = root.get();
+        while (node) {
+            if (less(key, node->entry.first)) node = node->left.get();
+            else if (less(node->entry.first, key)) node = node->right.get();
+            else return &node->entry.second;
+        }
+        return nullptr;
+    }
+
+    size_t count(const Key& key) const { return get(key) ? 1 : 0; }
+
+    const Value& at(const Key& key) const {
+        const Value* value = get(key);
+        if (!value) throw std::out_of_range("PersistentMap::at");
+        return *value;
+    }
+
+    const_iterator begin() const {
+        const_iterator it;
+        it.pushLeftmost(root.get());
+        return it;
+    }
+
+    const_iterator end() const { return const_iterator(); }
+
+    const_iterator find(const Key& key) const {
+        const_iterator it = lower_bound(key);
+        return it != end() && !less(key, it->first) ? it : end();
+    }
+
+    // First entry not before `key`
+    const_iterator lower_bound(const Key& key) const {
+        return seek([&](const Key& nodeKey) { return less(nodeKey, key); });
+    }
+
+    // First entry after `key`
+    const_iterator upper_bound(const Key& key) const {
+        return seek([&](const Key& nodeKey) { return !less(key, nodeKey); });
+    }
+
+    // Inserts the entry, or replaces the value if the key is present.
+    void set(const Key& key, const Value& value) {
+        bool inserted = false;
+        root = insert(root, key, value, inserted);
+        if (inserted) ++entries;
+    }
+
+    // Inserts the entry only if the key is absent; returns whether it did.
+    bool emplace(const Key& key, const Value& value) {
+        if (get(key)) return false;
+        set(key, value);
+        return true;
+    }
+
+    size_t erase(const Key& key) {
+        bool erased = false;
+        NodePtr updated = remove(root, key, erased);
+        if (!erased) return 0;
+        root = std::move(updated);
+        --entries;
+        return 1;
+    }
+
+    void clear() {
+        root.reset();
+        entries = 0;
+    }
+
+private:
+    struct Node {
+        Node(const Key& key, const Value& value, NodePtr left, NodePtr right)
+            : entry(key, value), left(std::move(left)), right(std::move(right)),
+              height(1 + std::max(heightOf(this->left), heightOf(this->right))) {}
+
+        value_type entry;
+        NodePtr left;
+        NodePtr right;
+        int height;
+    };
+
+    NodePtr root;
+    size_t entries = 0;
+
+    static bool less(const Key& a, const Key& b) { return Compare()(a, b); }
+    static int heightOf(const NodePtr& node) { return node ? node->height : 0; }
+
+    static NodePtr make(const Key& key, const Value& value, NodePtr left, NodePtr right) {
+        return std::make_shared<const Node>(key, value, std::move(left), std::move(right));
+    }
+
+    // Descends towards the first key for which goRight is false, keeping the path to it
+    template <typename GoRight>
+    const_iterator seek(GoRight goRight) const {
+        const_iterator it;
+        size_t keep = 0;
+        for (const Node* node = root.get(); node;) {
+            it.path.push_back(node);
+            if (goRight(node->entry.first)) {
+                node = node->right.get();
+            } else {
+                keep = it.path.size();
+                node = node->left.get();
+            }
+        }
+        it.path.resize(keep);
+        return it;
+    }
+
+    template <typename Iterator>
+    static NodePtr build(Iterator& next, size_t n) {
+        if (n == 0) return nullptr;
+        NodePtr left = build(next, n / 2);
+        const Key& key = next->first;
+        const Value& value = next->second;
+        ++next;
+        NodePtr right = build(next, n - n / 2 - 1);
+        return make(key, value, std::move(left), std::move(right));
+    }
+
+    // A node for (key, value) over the two subtrees, rotated back into AVL balance. The
+    // subtrees' heights differ by at most two, as they do after one insert or erase.
+    static NodePtr balance(const Key& key, const Value& value, NodePtr left, NodePtr right) {
+        int leftHeight = heightOf(left);
+        int rightHeight = heightOf(right);
+        if (leftHeight > rightHeight + 1) {
+            const Node& l = *left;
+            if (heightOf(l.left) >= heightOf(l.right)) {
+                return make(l.entry.first, l.entry.second, l.left, make(key, value, l.right, std::move(right)));
+            }
+            const Node& lr = *l.right;
+            return make(lr.entry.first, lr.entry.second, make(l.entry.first, l.entry.second, l.left, lr.left),
+                        make(key, value, lr.right, std::move(right)));
+        }
+        if (rightHeight > leftHeight + 1) {
+            const Node& r = *right;
+            if (heightOf(r.right) >= heightOf(r.left)) {
+                return make(r.entry.first, r.entry.second, make(key, value, std::move(left), r.left), r.right);
+            }
+            const Node& rl = *r.left;
+            return make(rl.entry.first, rl.entry.second, make(key, value, std::move(left), rl.left),
+                        make(r.entry.first, r.entry.second, rl.right, r.right));
+        }
+        return make(key, value, std::move(left), std::move(right));
+    }
+
+    static NodePtr insert(const NodePtr& node, const Key& key, const Value& value, bool& inserted) {
+        if (!node) {
+            inserted = true;
+            return make(key, value, nullptr, nullptr);
+        }
+        const value_type& entry = node->entry;
+        if (less(key, entry.first)) return balance(entry.first, entry.second, insert(node->left, key, value, inserted), node->right);
+        if (less(entry.first, key)) return balance(entry.first, entry.second, node->left, insert(node->right, key, value, inserted));
+        return make(entry.first, value, node->left, node->right);
+    }
+
+    static NodePtr removeLeftmost(const NodePtr& node) {
+        if (!node->left) return node->right;
+        return balance(node->entry.first, node->entry.second, removeLeftmost(node->left), node->right);
+    }
+
+    static NodePtr remove(const NodePtr& node, const Key& key, bool& erased) {
+        if (!node) return nullptr;
+        const value_type& entry = node->entry;
+        if (less(key, entry.first)) {
+            NodePtr left = remove(node->left, key, erased);
+            return erased ? balance(entry.first, entry.second, std::move(left), node->right) : node;
+        }
+        if (less(entry.first, key)) {
+            NodePtr right = remove(node->right, key, erased);
+            return erased ? balance(entry.first, entry.second, node->left, std::move(right)) : node;
+        }
+        erased = true;
+        if (!node->left) return node->right;
+        if (!node->right) return node->left;
+        const Node* successor = node->right.get();
+        while (successor->left) successor = successor->left.get();
+        return balance(successor->entry.first, successor->entry.second, node->left, removeLeftmost(node->right));
+    }
+};
+
+#endif
@@ -0,0 +1,472 @@
+// Embedded key/value record store shared by the Bank, Hotel and Library programs.
+//
+// A store named "bank" lives in two files:
+//   bank.pages  checkpoint of every live record, packed into checksummed 4 KiB pages
+//   bank.log    append-only log of changes made since the last checkpoint
+//
+// Changes are staged with put()/erase() and become durable as one unit on commit(): the
+// staged frames and a commit marker are appended to the log in a single write and synced.
+// On open, the pages are loaded and the log is replayed; a torn or corrupt tail (from a crash
+// mid-commit) is detected by its checksum, discarded, and truncated, so every committed
+// transaction survives and no partial one does. A damaged page is different: its records are
+// in no log any more, so the store refuses to open rather than serve what is left, unless
+// RECORD_STORE_SKIP_CORRUPT_PAGES=1 is set to accept the loss. When the log outgrows the pages it is folded
+// into a fresh page file, which replaces the old one atomically via rename.
+//
+// Only the key index is kept in memory; values are read from disk on lookup. The store is not
+// internally synchronized: callers serialize access the same way they do for their own state.
+// Across processes, the log file is locked while the store is open, so a second program
+// opening the same store fails instead of interleaving its writes with the first one's.
+//
+// Recovery, log flushes and checkpoints are timed as "<name>.store.recover", "<name>.store.flush"
+// and "<name>.store.checkpoint" in OperationStats.
+
+#ifndef RECORD_STORE_H
+#define RECORD_STORE_H
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "OperationStats.h"
+
+class RecordStore {
+public:
+    struct RecoveryStats {
+        size_t transactionsReplayed = 0;
+        size_t bytesDiscarded = 0;   // Torn or corrupt log tail dropped during recovery
+        size_t corruptPages = 0;     // Checkpoint pages skipped because their checksum failed (only when allowed)
+    };
+
+    explicit RecordStore(const std::string& name)
+        : pagesPath(name + ".pages"), logPath(name + ".log"),
+          recoverMetric(OperationStats::metric(name + ".store.recover")),
+          flushMetric(OperationStats::metric(name + ".store.flush")),
+          checkpointMetric(OperationStats::metric(name + ".store.checkpoint")) {
+        OperationTimer timer(recoverMetric);
+        pagesFd = ::open(pagesPath.c_str(), O_RDWR | O_CREAT, 0644);
+        logFd = ::open(logPath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (pagesFd < 0 || logFd < 0) {
+            closeFiles();
+            throw std::runtime_error("Unable to open record store " + name);
+        }
+        if (::flock(logFd, LOCK_EX | LOCK_NB) != 0) {
+            bool held = errno == EWOULDBLOCK;
+            closeFiles();
+            throw std::runtime_error(held ? "Record store " + name + " is in use by another process" : "Unable to lock record store " + name);
+        }
+        loadPages();
+        if (stats.corruptPages && !skipCorruptPages()) {
+            closeFiles();
+            throw std::runtime_error("Record store " + name + " has " + std::to_string(stats.corruptPages) +
+                                     " corrupt pages; set RECORD_STORE_SKIP_CORRUPT_PAGES=1 to open it without their records");
+        }
+        replayLog();
+    }
+
+    ~RecordStore() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+            // Nothing was acknowledged for unflushed transactions, so losing them is allowed.
+        }
+        closeFiles();
+    }
+
+    RecordStore(const RecordStore&) = delete;
+    RecordStore& operator=(const RecordStore&) = delete;
+
+    bool empty() const { return index.empty(); }
+    size_t size() const { return index.size(); }
+    const RecoveryStats& recoveryStats() const { return stats; }
+
+    // Looks up the last committed value for `key`. Staged, uncommitted changes are not visible.
+    bool get(const std::string& key, std::string& value) const {
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        value = readValue(it->second);
+        return true;
+    }
+
+    // Visits every committed record whose key starts with `prefix`, in key order. Checkpoints
+    // are written in key order, so values are read through a window that turns the scan into
+    // large sequential reads instead of one read per record.
+    void forEachPrefix(const std::string& prefix,
+                       const std::function<void(const std::string&, const std::string&)>& visit) const {
+        std::string window;
+        off_t windowStart = 0;
+        std::string value;
+        for (auto it = index.lower_bound(prefix); it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            const Location& location = it->second;
+            off_t windowEnd = windowStart + static_cast<off_t>(window.size());
+            if (!location.inPages || location.length > kScanWindow) {
+                value = readValue(location);
+            } else {
+                if (location.offset < windowStart || location.offset + static_cast<off_t>(location.length) > windowEnd) {
+                    windowStart = location.offset;
+                    window = readAll(pagesFd, windowStart, kScanWindow);
+                }
+                value.assign(window, static_cast<size_t>(location.offset - windowStart), location.length);
+            }
+            visit(it->first, value);
+        }
+    }
+
+    void put(const std::string& key, const std::string& value) { stage(kPut, key, value); }
+    void erase(const std::string& key) { stage(kErase, key, std::string()); }
+
+    // Bulk writers can encode puts on any thread with encodePut() and hand each buffer to
+    // stageEncoded() in order; the result is the same as calling put() for every record.
+    static void encodePut(std::string& frames, const std::string& key, const std::string& value) {
+        appendFrame(frames, kPut, key, value);
+    }
+    void stageEncoded(const std::string& frames) { staged += frames; }
+
+    // Discards every change staged since the last commit.
+    void rollback() { staged.clear(); }
+
+    // Makes every change staged since the last commit durable, atomically. With group commit
+    // enabled, the changes are only sealed as a transaction here and become durable on flush().
+    // Without it, a commit that throws has been discarded: it will not reach the store later,
+    // so the caller can undo its own in-memory changes and report the failure.
+    void commit() {
+        if (staged.empty()) return;
+        appendFrame(staged, kCommit, std::string(), std::string());
+        size_t sealedBefore = sealed.size();
+        if (sealed.empty()) sealed.swap(staged);
+        else sealed += staged;
+        staged.clear();
+        if (groupCommit) return;
+        try {
+            flush();
+        } catch (const std::exception&) {
+            sealed.resize(sealedBefore);
+            throw;
+        }
+    }
+
+    // Group commit: many small transactions share one write and one sync. Callers must flush()
+    // before acknowledging any of those transactions to anyone.
+    void setGroupCommit(bool enabled) {
+        groupCommit = enabled;
+        if (!enabled) flush();
+    }
+
+    // Writes and syncs every sealed transaction. If that fails they stay sealed and whatever
+    // part of them reached the file is cut off again, so a later open can't replay them; the
+    // next flush writes them again at the same offset. Until then the index (and so get())
+    // does not include them. Once the sync succeeds, flush() does not throw.
+    void flush() {
+        if (sealed.empty()) return;
+        OperationTimer timer(flushMetric);
+        off_t start = logSize;
+        try {
+            writeAll(logFd, sealed.data(), sealed.size(), start);
+            if (::fdatasync(logFd) != 0) throw std::runtime_error("Unable to sync " + logPath);
+        } catch (const std::exception&) {
+            if (::ftruncate(logFd, start) != 0) {}  // Best effort; the sync error is what gets reported
+            throw;
+        }
+        std::string frames;
+        frames.swap(sealed);
+        logSize += frames.size();
+        applyFrames(frames, start, nullptr);
+
+        if (logSize > kMinCheckpointBytes && logSize > pagesSize) {
+            try {
+                checkpoint();
+            } catch (const std::exception&) {
+                // The transactions are durable in the log either way; a later flush tries again.
+            }
+        }
+    }
+
+    // Rewrites all live records into a new page file and empties the log.
+    void checkpoint() {
+        flush();
+        if (logSize == 0) return;  // Pages already hold everything
+        OperationTimer timer(checkpointMetric);
+        std::string tmpPath = pagesPath + ".tmp";
+        int tmpFd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (tmpFd < 0) throw std::runtime_error("Unable to write " + tmpPath);
+
+        std::map<std::string, Location> rewritten;
+        std::string page;
+        off_t offset = 0;
+        std::vector<std::pair<std::string, Location>> pending;  // Records in the current page, offsets relative to it
+
+        auto flushPage = [&]() {
+            if (pending.empty()) return;
+            sealPage(page, pending.size());
+            writeAll(tmpFd, page.data(), page.size(), offset);
+            for (auto& record : pending) {
+                record.second.offset += offset;
+                rewritten.emplace_hint(rewritten.end(), std::move(record.first), record.second);
+            }
+            offset += page.size();
+            page.clear();
+            pending.clear();
+        };
+
+        for (const auto& entry : index) {
+            std::string value = readValue(entry.second);
+            size_t recordSize = 8 + entry.first.size() + value.size();
+            if (!pending.empty() && page.size() + recordSize > kPageSize) flushPage();
+            if (page.empty()) page.assign(kPageHeader, '\0');
+            appendU32(page, static_cast<uint32_t>(entry.first.size()));
+            appendU32(page, static_cast<uint32_t>(value.size()));
+            page += entry.first;
+            pending.emplace_back(entry.first, Location{ true, static_cast<off_t>(page.size()), entry.second.length });
+            page += value;
+        }
+        flushPage();
+
+        if (::fsync(tmpFd) != 0 || ::rename(tmpPath.c_str(), pagesPath.c_str()) != 0) {
+            ::close(tmpFd);
+            throw std::runtime_error("Unable to replace " + pagesPath);
+        }
+        ::close(pagesFd);
+        pagesFd = tmpFd;
+        pagesSize = offset;
+        index.swap(rewritten);  // The old pages are gone, so lookups must use the new ones from here on
+
+        // The log is only emptied once the rename itself is durable; if we crash before this,
+        // replaying the old log over either page file is harmless because puts and erases are absolute.
+        syncDirectory(pagesPath);
+        if (::ftruncate(logFd, 0) != 0 || ::fsync(logFd) != 0) throw std::runtime_error("Unable to truncate " + logPath);
+        logSize = 0;
+    }
+
+private:
+    enum FrameType : uint8_t { kPut = 1, kErase = 2, kCommit = 3 };
+
+    struct Location {
+        bool inPages;    // Which file holds the value
+        off_t offset;    // Offset of the value bytes within that file
+        uint32_t length;
+    };
+
+    static constexpr size_t kPageSize = 4096;
+    static constexpr size_t kPageHeader = 16;   // magic, crc, payload length, record count
+    static constexpr size_t kFrameHeader = 16;  // crc, type + padding, key length, value length
+    static constexpr uint32_t kPageMagic = 0x47504452;  // "RDPG"
+    static constexpr off_t kMinCheckpointBytes = 8 << 20;
+    static constexpr size_t kScanWindow = 256 << 10;
+
+    std::string pagesPath;
+    std::string logPath;
+    OperationMetric& recoverMetric;
+    OperationMetric& flushMetric;
+    OperationMetric& checkpointMetric;
+    int pagesFd = -1;
+    int logFd = -1;
+    off_t pagesSize = 0;
+    off_t logSize = 0;
+    std::map<std::string, Location> index;
+    std::string staged;  // Encoded frames of the transaction being built
+    std::string sealed;  // Committed transactions not yet written (group commit, or a failed flush)
+    bool groupCommit = false;
+    RecoveryStats stats;
+
+    static bool skipCorruptPages() {
+        const char* setting = std::getenv("RECORD_STORE_SKIP_CORRUPT_PAGES");
+        return setting && std::string(setting) == "1";
+    }
+
+    void closeFiles() {
+        if (pagesFd >= 0) ::close(pagesFd);
+        if (logFd >= 0) ::close(logFd);
+        pagesFd = logFd = -1;
+    }
+
+    // Standard CRC-32, computed eight bytes at a time ("slicing-by-8"); bulk writes spend most
+    // of their CPU time here.
+    static uint32_t crc32(const char* data, size_t length) {
+        typedef std::array<std::array<uint32_t, 256>, 8> Tables;
+        static const Tables tables = [] {
+            Tables t;
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int slice = 1; slice < 8; ++slice) t[slice][i] = (t[slice - 1][i] >> 8) ^ t[0][t[slice - 1][i] & 0xFF];
+            }
+            return t;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        for (; length >= 8; bytes += 8, length -= 8) {
+            uint32_t low = crc ^ (bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<uint32_t>(bytes[3]) << 24);
+            crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24] ^
+                  tables[3][bytes[4]] ^ tables[2][bytes[5]] ^ tables[1][bytes[6]] ^ tables[0][bytes[7]];
+        }
+        while (length--) crc = tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    // Makes a rename of `path` durable by syncing the directory that holds it.
+    static void syncDirectory(const std::string& path) {
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        bool synced = fd >= 0 && ::fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        if (!synced) throw std::runtime_error("Unable to sync directory " + directory);
+    }
+
+    static void appendU32(std::string& out, uint32_t value) { out.append(reinterpret_cast<const char*>(&value), 4); }
+
+    static uint32_t readU32(const char* data) {
+        uint32_t value;
+        std::memcpy(&value, data, 4);
+        return value;
+    }
+
+    // Fills in the header of an encoded page and pads it to a whole number of pages.
+    // Records larger than a page get an oversized page of their own.
+    static void sealPage(std::string& page, size_t recordCount) {
+        uint32_t payload = static_cast<uint32_t>(page.size() - kPageHeader);
+        page.resize((page.size() + kPageSize - 1) / kPageSize * kPageSize, '\0');
+        uint32_t header[4] = { kPageMagic, 0, payload, static_cast<uint32_t>(recordCount) };
+        std::memcpy(&page[0], header, sizeof(header));
+        uint32_t crc = crc32(page.data() + 8, kPageHeader - 8 + payload);
+        std::memcpy(&page[4], &crc, 4);
+    }
+
+    static void writeAll(int fd, const char* data, size_t length, off_t offset) {
+        while (length > 0) {
+            ssize_t written = ::pwrite(fd, data, length, offset);
+            if (written <= 0) throw std::runtime_error("Record store write failed");
+            data += written;
+            length -= written;
+            offset += written;
+        }
+    }
+
+    static std::string readAll(int fd, off_t offset, size_t length) {
+        std::string data(length, '\0');
+        size_t done = 0;
+        while (done < length) {
+            ssize_t got = ::pread(fd, &data[done], length - done, offset + done);
+            if (got <= 0) break;
+            done += got;
+        }
+        data.resize(done);
+        return data;
+    }
+
+    std::string readValue(const Location& location) const {
+        std::string value = readAll(location.inPages ? pagesFd : logFd, location.offset, location.length);
+        if (value.size() != location.length) throw std::runtime_error("Record store read failed");
+        return value;
+    }
+
+    static void appendFrame(std::string& out, FrameType type, const std::string& key, const std::string& value) {
+        size_t start = out.size();
+        appendU32(out, 0);
+        appendU32(out, type);
+        appendU32(out, static_cast<uint32_t>(key.size()));
+        appendU32(out, static_cast<uint32_t>(value.size()));
+        out += key;
+        out += value;
+        uint32_t crc = crc32(out.data() + start + 4, out.size() - start - 4);
+        std::memcpy(&out[start], &crc, 4);
+    }
+
+    void stage(FrameType type, const std::string& key, const std::string& value) { appendFrame(staged, type, key, value); }
+
+    // Applies the put/erase frames in `frames` (which sit at `base` in the log) to the index.
+    // With `committedEnd` set, stops at the first damaged frame and reports where the last
+    // complete transaction ended; otherwise the frames are trusted (we just wrote them).
+    void applyFrames(const std::string& frames, off_t base, size_t* committedEnd) {
+        std::vector<std::pair<std::string, Location>> transaction;  // Erases have length UINT32_MAX
+        size_t pos = 0;
+        while (pos + kFrameHeader <= frames.size()) {
+            const char* frame = frames.data() + pos;
+            uint32_t type = readU32(frame + 4);
+            uint32_t keyLength = readU32(frame + 8);
+            uint32_t valueLength = readU32(frame + 12);
+            size_t frameSize = kFrameHeader + static_cast<size_t>(keyLength) + valueLength;
+            if (frameSize > frames.size() - pos) break;
+            if (committedEnd && readU32(frame) != crc32(frame + 4, frameSize - 4)) break;
+
+            if (type == kCommit) {
+                for (auto& change : transaction) {
+                    if (change.second.length == UINT32_MAX) index.erase(change.first);
+                    else index[change.first] = change.second;
+                }
+                transaction.clear();
+                if (committedEnd) {
+                    *committedEnd = pos + frameSize;
+                    ++stats.transactionsReplayed;
+                }
+            } else {
+                std::string key(frame + kFrameHeader, keyLength);
+                off_t valueOffset = base + static_cast<off_t>(pos + kFrameHeader + keyLength);
+                transaction.emplace_back(key, Location{ false, valueOffset, type == kErase ? UINT32_MAX : valueLength });
+            }
+            pos += frameSize;
+        }
+    }
+
+    void loadPages() {
+        pagesSize = ::lseek(pagesFd, 0, SEEK_END);
+        off_t offset = 0;
+        while (offset + static_cast<off_t>(kPageHeader) <= pagesSize) {
+            std::string header = readAll(pagesFd, offset, kPageHeader);
+            uint32_t payload = readU32(header.data() + 8);
+            size_t pageSize = (kPageHeader + payload + kPageSize - 1) / kPageSize * kPageSize;
+            if (readU32(header.data()) != kPageMagic || offset + static_cast<off_t>(pageSize) > pagesSize) {
+                // Header is damaged, so its length can't be trusted; resync at the next page boundary.
+                ++stats.corruptPages;
+                offset += kPageSize;
+                continue;
+            }
+
+            std::string page = readAll(pagesFd, offset, kPageHeader + payload);
+            if (readU32(page.data() + 4) != crc32(page.data() + 8, page.size() - 8)) {
+                ++stats.corruptPages;
+                offset += pageSize;
+                continue;
+            }
+
+            uint32_t recordCount = readU32(page.data() + 12);
+            size_t pos = kPageHeader;
+            for (uint32_t i = 0; i < recordCount && pos + 8 <= page.size(); ++i) {
+                uint32_t keyLength = readU32(page.data() + pos);
+                uint32_t valueLength = readU32(page.data() + pos + 4);
+                std::string key(page.data() + pos + 8, keyLength);
+                index[key] = Location{ true, offset + static_cast<off_t>(pos + 8 + keyLength), valueLength };
+                pos += 8 + keyLength + valueLength;
+            }
+            offset += pageSize;
+        }
+    }
+
+    void replayLog() {
+        off_t size = ::lseek(logFd, 0, SEEK_END);
+        std::string log = readAll(logFd, 0, static_cast<size_t>(size));
+        size_t committedEnd = 0;
+        applyFrames(log, 0, &committedEnd);
+        if (committedEnd < log.size()) {
+            stats.bytesDiscarded = log.size() - committedEnd;
+            if (::ftruncate(logFd, committedEnd) != 0) throw std::runtime_error("Unable to truncate " + logPath);
+        }
+        logSize = committedEnd;
+    }
+};
+
+#endif